@@ -0,0 +1,179 @@
+/*** includes ***/
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "editor.h"
+#include "input.h"
+#include "load.h"
+#include "output.h"
+#include "swap.h"
+#include "terminal.h"
+
+/*** counters ***/
+// Headless driver: keys are queued with editorFeedInput and go through
+// editorProcessKeypress, frames go to a counting sink instead of the tty.
+// Allocations are counted by wrapping malloc and friends at link time.
+static long allocs = 0;
+static long frames = 0;
+static long frame_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  allocs++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocs++;
+  return __real_realloc(p, size);
+}
+
+void countFrame(const char *buf, int len) {
+  (void)buf;
+  frames++;
+  frame_bytes += len;
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*** scenarios ***/
+struct scenario {
+  const char *name;
+  double start;
+  long ops;  // Keypresses handled by editorProcessKeypress
+  long allocs;
+  long frames;
+  long frame_bytes;
+};
+
+void scenarioStart(struct scenario *s, const char *name) {
+  s->name = name;
+  s->ops = 0;
+  s->allocs = allocs;
+  s->frames = frames;
+  s->frame_bytes = frame_bytes;
+  s->start = now();
+}
+
+void scenarioReport(struct scenario *s) {
+  double elapsed = now() - s->start;
+  long nframes = frames - s->frames;
+  long ops = s->ops ? s->ops : 1;
+  printf("%-8s %8ld ops %10.3f s %12.2f us/op %8ld frames %9.0f B/frame "
+         "%10ld allocs\n",
+         s->name, s->ops, elapsed, elapsed * 1e6 / ops, nframes,
+         nframes ? (double)(frame_bytes - s->frame_bytes) / nframes : 0.0,
+         allocs - s->allocs);
+}
+
+// Processes every queued key, redrawing once per keypress like an
+// interactive session where keys arrive one at a time. A prompt such as a
+// whole search counts as one keypress.
+void replay(struct scenario *s, const char *keys, int len) {
+  editorFeedInput(keys, len);
+  while (editorInputPending()) {
+    editorProcessKeypress();
+    editorRefreshScreen();
+    s->ops++;
+  }
+}
+
+void generateFile(const char *path, long bytes) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  long written = 0;
+  for (long i = 0; written < bytes; i++)
+    written += fprintf(fp,
+                       "int value_%ld = %ld; /* generated line */ "
+                       "\"text\"\n",
+                       i, i * 7);
+  fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+  long megabytes = 1024;
+  int searches = 1000;
+  int chars = 10000;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:c:")) != -1) {
+    if (opt == 's') megabytes = atol(optarg);
+    if (opt == 'n') searches = atoi(optarg);
+    if (opt == 'c') chars = atoi(optarg);
+  }
+
+  int devnull = open("/dev/null", O_RDONLY);
+  dup2(devnull, STDIN_FILENO);
+  close(devnull);
+
+  char path[] = "/tmp/avi-bench-XXXXXX.c";
+  int fd = mkstemps(path, 2);
+  if (fd == -1) die("mkstemps");
+  close(fd);
+  generateFile(path, megabytes * 1024 * 1024);
+
+  initEditor();
+  editorSetScreenSize(50, 160);
+  editorFrameSink = countFrame;
+  struct scenario s;
+
+  scenarioStart(&s, "open");
+  editorOpen(path);
+  // The file loads in the background; the scenario covers the whole load.
+  editorLoadWait();
+  editorRefreshScreen();
+  scenarioReport(&s);
+
+  scenarioStart(&s, "type");
+  char *keys = malloc(chars + 2);
+  keys[0] = 'i';
+  for (int i = 0; i < chars; i++)
+    keys[i + 1] = (i % 80 == 79) ? '\r' : 'a' + i % 26;
+  keys[chars + 1] = '\x1b';
+  replay(&s, keys, chars + 2);
+  free(keys);
+  scenarioReport(&s);
+
+  scenarioStart(&s, "search");
+  srand(1);
+  long lines = E.numrows;
+  for (int i = 0; i < searches; i++) {
+    char query[64];
+    int len = snprintf(query, sizeof(query), "/value_%ld =\r",
+                       lines ? rand() % lines : 0);
+    replay(&s, query, len);
+  }
+  scenarioReport(&s);
+
+  scenarioStart(&s, "undo");
+  int undos = chars + 1;
+  keys = malloc(undos);
+  memset(keys, 'u', undos);
+  replay(&s, keys, undos);
+  free(keys);
+  scenarioReport(&s);
+
+  // The loaded file has a swap file next to it, which goes with it.
+  editorSwapClose();
+  unlink(path);
+  return 0;
+}
@@ -1,15 +1,15 @@
 #ifndef DEFINITIONS_HEADER
 #define DEFINITIONS_HEADER
 
+#include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 
-#include "history.h"
-
 /*** defines ***/
 #define AVI_VERSION "0.0.1"
 #define AVI_TAB_STOP 8
 #define COL_OFFSET 3
+#define AVI_LONG_LINE (1 << 16)  // Rows this long only render near E.coloff
 
 #define CTRL_KEY(k) ((k)&0x1f)
 
@@ -23,7 +23,8 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_KEY  // A bracketed paste, the text is taken with editorTakePaste
 };
 
 enum editorMode { NORMAL = 0, INSERT, VISUAL, COMMAND };
@@ -37,18 +38,39 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  char *quotes;                    // String quotes, or NULL for " and '
+  struct syntaxMachine *machine;  // Compiled when first selected
+};
+
+struct tabStop {
+  int cx;  // Position of the tab in chars
+  int rx;  // Render column just after the tab
 };
 
 typedef struct erow {
-  int idx;
   int size;
+  int capacity;  // Allocated bytes of chars, 0 while chars points into E.map
+  int gap;       // Long rows: chars[gap, gap + capacity - size) is unused,
+                 // -1 while chars is contiguous
   int rsize;
   char *chars;
-  char *render;
+  char *render;  // NULL until the row is first drawn or edited
+  int roff;      // Render column of render[0], -1 if the window is stale
+  int rwindow;   // render only holds a window of a long row
+  struct tabStop *tabs;  // Tabs in chars, built together with render
+  int ntabs;
+  int snapshot;  // Id of the save snapshot that shares chars, see save.c
   unsigned char *hl;
+  int hl_in;  // Comment state hl was built from, -1 if hl is stale
   int hl_open_comment;
 } erow;
 
+struct rowBuffer {
+  erow *rows;
+  int gap;     // Index of the first unused slot
+  int gaplen;  // Number of unused slots
+};
+
 struct editorConfig {
   int cx, cy;  // Cursor position
   int rx;
@@ -57,19 +79,23 @@ struct editorConfig {
   int screenrows;  // Height of screen
   int screencols;  // Width of screen
   int numrows;     // Number of rows in file
-  erow *row;
+  int hl_frontier;  // Rows above this one have a known hl_open_comment
+  struct rowBuffer rowbuf;
+  int gaprow;  // The one row whose text has a gap, or -1
   int dirty;  // Indicates if file has been modified
   int mode;
   int command_quantifier;
   char prevCommand;
-  history_level undo_level;
-  history_level redo_level;
   char *filename;
+  char *map;  // Read-only mapping of the opened file, rows borrow from it
+  int snapshot;  // Id of the snapshot a running save writes, or 0
+  off_t filesize;  // Size of the file as last read or saved
+  size_t maplen;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
   struct termios orig_termios;
 };
-struct editorConfig E;
+extern struct editorConfig E;
 
 #endif
@@ -0,0 +1,6 @@
+#ifndef EDITOR_HEADER
+#define EDITOR_HEADER
+
+void initEditor();
+
+#endif
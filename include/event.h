@@ -0,0 +1,9 @@
+#ifndef EVENT_HEADER
+#define EVENT_HEADER
+
+void editorInitEvents();
+void editorWatchFd(int fd, void (*callback)(int fd));
+void editorUnwatchFd(int fd);
+int editorWaitForInput(int timeout);
+
+#endif
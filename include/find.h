@@ -1,6 +1,10 @@
 #ifndef FIND_HEADER
 #define FIND_HEADER
 
+#include "definitions.h"
+
 void editorFind();
+void editorFindClearHighlight();
+int editorFindOverlay(erow *row, int rx, int width, unsigned char *mark);
 
 #endif
@@ -0,0 +1,8 @@
+#ifndef FOLLOW_HEADER
+#define FOLLOW_HEADER
+
+void editorFollowStart();
+void editorFollowStop();
+int editorFollowing();
+
+#endif
@@ -18,8 +18,11 @@ enum editorHighlight {
   HL_MATCH
 };
 
-void editorUpdateSyntax(erow *);
+void editorUpdateSyntax(erow *row, int in_comment);
+void editorInvalidateSyntax(int at);
+void editorHighlightRows(int from, int to);
 void editorSelectSyntaxHighlight();
+void editorAddSyntax(struct editorSyntax *s);
 int editorSyntaxToColor(int);
 
 #endif
@@ -1,25 +1,42 @@
 #ifndef HISTORY_HEADER
 #define HISTORY_HEADER
 
-#define MAX_HISTORY 1000
+#include <stddef.h>
+#include <stdint.h>
 
-typedef struct history_level {
-  int level;
-  int wraps;
-} history_level;
-
-struct history_action {
-  int uy;
-  int ux;
-  int c;
-  int end;
+// The text of one row, saved by a command that rewrites whole rows.
+struct rowText {
+  int at;
+  char *text;
+  int len;
 };
 
-struct history_action undo_history[MAX_HISTORY];
-struct history_action redo_history[MAX_HISTORY];
+// Hash state for content fed in pieces.
+struct contentHash {
+  uint64_t h;
+  char tail[8];
+  int ntail;
+};
 
-void addUndo(char c);
+void closeUndoGroup();
+void addUndoInsert(int y, int x, const char *s, int len);
+void addUndoDelete(int y, int x, const char *s, int len);
+void addUndoInsertRow(int at);
+void addUndoDeleteRow(int at, const char *s, int len);
+void addUndoRows(int y, int x, struct rowText *rows, int nrows);
 void doRedo();
 void doUndo();
+void editorHashInit(struct contentHash *c, uint64_t len);
+void editorHashUpdate(struct contentHash *c, const char *p, size_t len);
+uint64_t editorHashFinal(struct contentHash *c);
+uint64_t editorContentHash(const char *p, size_t len);
+char *editorSideFilePath(const char *filename, const char *suffix);
+int editorHashFile(const char *filename, uint64_t *size, uint64_t *hash);
+void editorLoadUndoFile(const char *filename);
+void editorLoadUndoFileHashed(const char *filename, uint64_t size,
+                              uint64_t hash);
+int editorUndoMark();
+void editorSaveUndoFile(const char *filename, uint64_t size, uint64_t hash,
+                        int at);
 
 #endif
@@ -1,10 +1,13 @@
 #ifndef INPUT_HEADER
 #define INPUT_HEADER
 
+int editorReadOnly();
 void editorProcessKeypress();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void editorDelChar();
 void editorInsertChar(int c);
+void editorInsertText(char *s, int len);
+void editorDeleteText(int y, int x, char *s, int len);
 void editorOpen(char *filename);
 
 #endif
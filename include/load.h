@@ -0,0 +1,9 @@
+#ifndef LOAD_HEADER
+#define LOAD_HEADER
+
+int editorLoadStart(const char *filename);
+int editorLoading();
+void editorLoadWait();
+int editorLoadStatus(char *buf, int size);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef MATCH_INDEX_HEADER
+#define MATCH_INDEX_HEADER
+
+struct match {
+  int row;
+  int col;
+  int len;
+};
+
+void editorMatchIndexStart(const char *query, int regex);
+void editorMatchIndexStop();
+void editorMatchIndexInvalidate(int from);
+void editorMatchIndexUpdate();
+int editorMatchIndexReady();
+int editorMatchIndexSeek(int row, int col, int direction, struct match *m);
+void editorMatchIndexSetCurrent(int row, int col);
+int editorMatchIndexStatus(char *buf, int size);
+
+#endif
@@ -1,7 +1,22 @@
 #ifndef OUTPUT_HEADER
 #define OUTPUT_HEADER
 
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+#define ABUF_INIT \
+  { NULL, 0, 0 }
+
+void abAppend(struct abuf *ab, const char *s, int len);
+void abFree(struct abuf *ab);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorCheckWindowSize();
+void editorSetScreenSize(int rows, int cols);
+
+extern void (*editorFrameSink)(const char *buf, int len);
 
 #endif
@@ -0,0 +1,21 @@
+#ifndef PATTERN_HEADER
+#define PATTERN_HEADER
+
+#include <stdatomic.h>
+
+struct pattern;
+
+struct pattern *patternCompile(const char *re);
+void patternFree(struct pattern *p);
+void patternSetCancel(struct pattern *p, const atomic_int *cancel);
+int patternMatch(struct pattern *p, const char *text, int len, int col,
+                 int *start, int *end);
+int patternMatchWindow(struct pattern *p, const char *text, int len, int col,
+                       int bol, int eol, int *start, int *end);
+int patternMatchLast(struct pattern *p, const char *text, int len, int from,
+                     int col, int *start, int *end);
+void patternMatchAll(struct pattern *p, const char *text, int len,
+                     void (*report)(void *arg, int start, int end),
+                     void *arg);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef ROW_BUFFER_HEADER
+#define ROW_BUFFER_HEADER
+
+#include "definitions.h"
+
+erow *editorRow(int at);
+int editorRowIndex(erow *row);
+erow *editorRowBufferInsert(int at);
+void editorRowBufferDelete(int at);
+
+#endif
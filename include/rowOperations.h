@@ -5,11 +5,21 @@
 
 int editorRowCxToRx(erow *row, int cx);
 int editorRowRxToCx(erow *row, int rx);
+char *editorRowChars(erow *row);
+char editorRowCharAt(erow *row, int at);
+void editorCloseGap();
 void editorUpdateRow(erow *row);
+void editorPrepareRow(erow *row);
+void editorAppendMappedRow(char *s, size_t len);
 void editorInsertRow(int at, char *s, size_t len);
 void editorDelRow(int at);
+void editorUnmapRows();
 void editorRowInsertChar(erow *row, int at, int c);
 void editorRowAppendString(erow *row, char *s, size_t len);
+void editorRowInsertString(erow *row, int at, char *s, size_t len);
+void editorRowDelChars(erow *row, int at, int len);
 void editorRowDelChar(erow *row, int at);
+void editorRowTruncate(erow *row, int size);
+void editorRowSwapText(erow *row, char **text, int *len);
 
 #endif
@@ -0,0 +1,10 @@
+#ifndef SAVE_HEADER
+#define SAVE_HEADER
+
+#include "definitions.h"
+
+void editorSave();
+int editorSaveWait();
+void editorSaveRetire(char *chars);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SEARCH_HEADER
+#define SEARCH_HEADER
+
+#include <stddef.h>
+
+#include "pattern.h"
+
+const char *searchMemmem(const char *hay, size_t hlen, const char *needle,
+                         size_t nlen);
+const char *searchMemmemLast(const char *hay, size_t hlen, const char *needle,
+                             size_t nlen);
+int editorSpanEnd(int at, int limit);
+int editorSpanRow(int from, int to, const char *p);
+int editorSearchForward(const char *needle, int nlen, int row, int col,
+                        int endrow, int *mrow, int *mcol);
+int editorSearchBackward(const char *needle, int nlen, int row, int col,
+                         int endrow, int endcol, int *mrow, int *mcol);
+int editorPatternForward(struct pattern *p, int row, int col, int endrow,
+                         int *mrow, int *mcol, int *mlen);
+int editorPatternBackward(struct pattern *p, int row, int col, int endrow,
+                          int endcol, int *mrow, int *mcol, int *mlen);
+
+#endif
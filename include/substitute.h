@@ -0,0 +1,6 @@
+#ifndef SUBSTITUTE_HEADER
+#define SUBSTITUTE_HEADER
+
+int editorSubstitute(char *command);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SWAP_HEADER
+#define SWAP_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum swapKind {
+  SWAP_INSERT = 1,
+  SWAP_DELETE,
+  SWAP_INSERT_ROW,
+  SWAP_DELETE_ROW,
+  SWAP_SET_ROW
+};
+
+void editorSwapOpen(const char *filename);
+void editorSwapChange(int kind, int y, int x, const char *s, int len);
+void editorSwapMark();
+void editorSwapUnmark();
+void editorSwapSaved(uint64_t size, uint64_t hash);
+void editorSwapClose();
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SYNTAX_HEADER
+#define SYNTAX_HEADER
+
+void editorLoadSyntaxFiles();
+
+#endif
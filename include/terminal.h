@@ -5,6 +5,10 @@ void die(const char *s);
 void cleanExit();
 void enableRawMode();
 int editorReadKey();
+int editorInputPending();
+void editorFeedInput(const char *s, int len);
+char *editorTakePaste(int *len);
+int getWindowSizeIoctl(int *rows, int *cols);
 int getWindowSize(int *rows, int *cols);
 
 #endif
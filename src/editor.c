@@ -0,0 +1,33 @@
+#include "editor.h"
+
+#include "definitions.h"
+
+struct editorConfig E;
+
+/*** init ***/
+void initEditor() {
+  E.cx = COL_OFFSET;
+  E.cy = 0;
+  E.rx = COL_OFFSET;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.numrows = 0;
+  E.hl_frontier = 0;
+  E.rowbuf.rows = NULL;
+  E.rowbuf.gap = 0;
+  E.rowbuf.gaplen = 0;
+  E.gaprow = -1;
+  E.dirty = 0;
+  E.mode = NORMAL;
+  E.command_quantifier = 0;
+  E.prevCommand = ' ';
+  E.filename = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.snapshot = 0;
+  E.filesize = 0;
+  E.statusmsg[0] = '\0';
+  E.statusmsg_time = 0;
+  E.syntax = NULL;
+}
+
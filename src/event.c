@@ -0,0 +1,113 @@
+#include "event.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "terminal.h"
+
+/*** event loop ***/
+// The editor sleeps in poll() until a key arrives or one of the watched
+// descriptors becomes readable, so an idle editor never wakes up.
+#define MAX_WATCHES 16
+
+struct watch {
+  int fd;
+  void (*callback)(int fd);
+};
+
+static struct watch watches[MAX_WATCHES];
+static int nwatches = 0;
+static int winch_pipe[2] = {-1, -1};
+
+void editorWatchFd(int fd, void (*callback)(int fd)) {
+  if (nwatches == MAX_WATCHES) die("editorWatchFd");
+  watches[nwatches].fd = fd;
+  watches[nwatches].callback = callback;
+  nwatches++;
+}
+
+void editorUnwatchFd(int fd) {
+  for (int i = 0; i < nwatches; i++) {
+    if (watches[i].fd == fd) {
+      watches[i] = watches[--nwatches];
+      return;
+    }
+  }
+}
+
+void handleSigwinch(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  write(winch_pipe[1], "", 1);
+  errno = saved_errno;
+}
+
+// The screen is redrawn at the new size, as after every dispatched event.
+void drainSigwinch(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  editorCheckWindowSize();
+}
+
+void editorInitEvents() {
+  if (pipe(winch_pipe) == -1) die("pipe");
+  fcntl(winch_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(winch_pipe[1], F_SETFL, O_NONBLOCK);
+  editorWatchFd(winch_pipe[0], drainSigwinch);
+
+  struct sigaction sa;
+  sa.sa_handler = handleSigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &sa, NULL);
+}
+
+long monotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits up to timeout milliseconds, or forever if negative, for input on
+// stdin. Events on watched descriptors are dispatched while waiting and the
+// screen is refreshed after them. Returns 1 if stdin is readable.
+int editorWaitForInput(int timeout) {
+  long deadline = timeout < 0 ? -1 : monotonicMillis() + timeout;
+  while (1) {
+    struct pollfd fds[MAX_WATCHES + 1];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < nwatches; i++) {
+      fds[i + 1].fd = watches[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    int wait = -1;
+    if (deadline >= 0) {
+      wait = deadline - monotonicMillis();
+      if (wait < 0) wait = 0;
+    }
+    int n = poll(fds, nwatches + 1, wait);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    if (n == 0) return 0;
+    if (fds[0].revents) return 1;
+
+    int dispatched = 0;
+    for (int i = nwatches; i > 0; i--) {
+      if (fds[i].revents && i - 1 < nwatches &&
+          watches[i - 1].fd == fds[i].fd) {
+        watches[i - 1].callback(fds[i].fd);
+        dispatched = 1;
+      }
+    }
+    if (dispatched) editorRefreshScreen();
+  }
+}
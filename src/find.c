@@ -1,60 +1,220 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "definitions.h"
-#include "highlight.h"
 #include "input.h"
+#include "matchIndex.h"
+#include "pattern.h"
+#include "rowBuffer.h"
 #include "rowOperations.h"
+#include "search.h"
+
+/*** search highlight ***/
+// The last search stays highlighted until :noh. Its matches in the visible
+// rows are found again at draw time and laid over the syntax colours, so
+// highlighting never touches a row's hl.
+#define OVERLAY_SLOP 1024  // bytes around the window searched in long rows
+
+static char *hl_query = NULL;
+static struct pattern *hl_pattern = NULL;
+
+void editorFindClearHighlight() {
+  free(hl_query);
+  hl_query = NULL;
+  patternFree(hl_pattern);
+  hl_pattern = NULL;
+}
+
+void editorFindSetHighlight(const char *query, int regex) {
+  editorFindClearHighlight();
+  if (!query[0]) return;
+  if (regex && !(hl_pattern = patternCompile(query))) return;
+  hl_query = strdup(query);
+}
+
+// Marks the render columns [rx, rx + width) of a row that fall inside a
+// match. Returns 0 if none do.
+int editorFindOverlay(erow *row, int rx, int width, unsigned char *mark) {
+  static char *window = NULL;
+  if (!hl_query || width <= 0) return 0;
+  int nlen = strlen(hl_query);
+  // Long rows are only searched around the part on screen, copied out so
+  // that their edit gap stays where it is.
+  int base = 0, len = row->size;
+  char *text;
+  if (row->size >= AVI_LONG_LINE) {
+    int slop = hl_pattern ? OVERLAY_SLOP : nlen;
+    base = editorRowRxToCx(row, rx) - slop;
+    if (base < 0) base = 0;
+    int end = editorRowRxToCx(row, rx + width) + slop;
+    if (end > row->size) end = row->size;
+    len = end - base;
+    window = realloc(window, len + 1);
+    for (int i = 0; i < len; i++) window[i] = editorRowCharAt(row, base + i);
+    text = window;
+  } else {
+    text = editorRowChars(row);
+  }
+
+  int marked = 0;
+  int col = 0;
+  while (col < len) {
+    int start, end;
+    if (hl_pattern) {
+      if (!patternMatchWindow(hl_pattern, text, len, col, base == 0,
+                              base + len == row->size, &start, &end))
+        break;
+    } else {
+      const char *m = searchMemmem(&text[col], len - col, hl_query, nlen);
+      if (!m) break;
+      start = m - text;
+      end = start + nlen;
+    }
+    int rs = editorRowCxToRx(row, base + start) - rx;
+    int re = editorRowCxToRx(row, base + end) - rx;
+    if (rs >= width) break;
+    if (rs < 0) rs = 0;
+    if (re > width) re = width;
+    if (!marked && rs < re) {
+      memset(mark, 0, width);
+      marked = 1;
+    }
+    if (rs < re) memset(&mark[rs], 1, re - rs);
+    col = end > start ? end : start + 1;
+  }
+  return marked;
+}
 
 /*** find ***/
+#define FIND_PROMPT "Search: %s (Use ESC/Arrows/Enter, ^R regex)"
+#define FIND_REGEX_PROMPT "Regex: %s (Use ESC/Arrows/Enter, ^R literal)"
+
+// Ctrl-R switches between literal and regular expression search. The
+// prompt buffer is rewritten in place, as editorPrompt formats it anew for
+// every key.
+static int find_regex = 0;
+static char find_prompt[64] = FIND_PROMPT;
+
+int editorFindForward(struct pattern *pattern, char *query, int row, int col,
+                      int endrow, int *mrow, int *mcol, int *mlen) {
+  if (pattern)
+    return editorPatternForward(pattern, row, col, endrow, mrow, mcol, mlen);
+  *mlen = strlen(query);
+  return editorSearchForward(query, *mlen, row, col, endrow, mrow, mcol);
+}
+
+int editorFindBackward(struct pattern *pattern, char *query, int row, int col,
+                       int endrow, int endcol, int *mrow, int *mcol,
+                       int *mlen) {
+  if (pattern)
+    return editorPatternBackward(pattern, row, col, endrow, endcol, mrow, mcol,
+                                 mlen);
+  *mlen = strlen(query);
+  return editorSearchBackward(query, *mlen, row, col, endrow, endcol, mrow,
+                              mcol);
+}
+
 void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
+  static int last_row = -1;
+  static int last_col;
   static int direction = 1;
+  // The query the last search ran for, so that typing another character
+  // can resume from the previous match instead of the top of the file.
+  static char *last_query = NULL;
+  static struct pattern *pattern = NULL;
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
-
+  int regex = find_regex;
+  int row = 0, col = 0, len;
+  int found;
+  // :follow may have dropped the rows of the last match.
+  if (last_row >= E.numrows) last_row = -1;
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
+    last_row = -1;
     direction = 1;
+    free(last_query);
+    last_query = NULL;
+    patternFree(pattern);
+    pattern = NULL;
+    editorMatchIndexStop();
+    if (key == '\x1b') editorFindClearHighlight();
+    find_regex = 0;
+    strcpy(find_prompt, FIND_PROMPT);
     return;
   } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
     direction = 1;
   } else if (key == ARROW_LEFT || key == ARROW_UP) {
     direction = -1;
   } else {
-    last_match = -1;
+    if (key == CTRL_KEY('r')) {
+      regex = find_regex = !find_regex;
+      strcpy(find_prompt, regex ? FIND_REGEX_PROMPT : FIND_PROMPT);
+      free(last_query);
+      last_query = NULL;
+    }
+    if (!last_query || strcmp(query, last_query)) {
+      editorMatchIndexStart(query, regex);
+      editorFindSetHighlight(query, regex);
+    }
+    // Every match of the longer literal is a match of the shorter one, so
+    // nothing before the previous match can match now. Regular
+    // expressions get no such guarantee and always start over.
+    int extends = !regex && last_query &&
+                  !strncmp(query, last_query, strlen(last_query));
+    if (extends && last_row == -1 && last_query[0]) {
+      free(last_query);
+      last_query = strdup(query);
+      return;
+    }
+    if (extends && last_row != -1) {
+      row = last_row;
+      col = last_col;
+    }
+    free(last_query);
+    last_query = strdup(query);
+    patternFree(pattern);
+    pattern = regex && query[0] ? patternCompile(query) : NULL;
+    last_row = -1;
     direction = 1;
   }
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render) + COL_OFFSET;
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+  if (!query[0] || E.numrows == 0 || (regex && !pattern)) return;
+
+  struct match m;
+  if (last_row != -1 &&
+      editorMatchIndexSeek(last_row, last_col, direction, &m)) {
+    // Once the index is complete, stepping through matches is a lookup.
+    found = 1;
+    row = m.row;
+    col = m.col;
+    len = m.len;
+  } else if (last_row == -1) {
+    found = editorFindForward(pattern, query, row, col, E.numrows, &row, &col,
+                              &len);
+    if (!found && (row || col))
+      found = editorFindForward(pattern, query, 0, 0, E.numrows, &row, &col,
+                                &len);
+  } else if (direction == 1) {
+    found = editorFindForward(pattern, query, last_row, last_col + 1,
+                              E.numrows, &row, &col, &len) ||
+            editorFindForward(pattern, query, 0, 0, last_row + 1, &row, &col,
+                              &len);
+  } else {
+    found = editorFindBackward(pattern, query, last_row, last_col, 0, 0, &row,
+                               &col, &len) ||
+            editorFindBackward(pattern, query, E.numrows - 1, INT_MAX,
+                               last_row, last_col + 1, &row, &col, &len);
+  }
+  if (!found) {
+    last_row = -1;
+    return;
   }
+
+  last_row = row;
+  last_col = col;
+  editorMatchIndexSetCurrent(row, col);
+  E.cy = row;
+  E.cx = col + COL_OFFSET;
+  E.rowoff = E.numrows;
 }
 
 void editorFind() {
@@ -63,8 +223,7 @@ void editorFind() {
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-  char *query =
-      editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  char *query = editorPrompt(find_prompt, editorFindCallback);
 
   if (query) {
     free(query);
@@ -0,0 +1,206 @@
+#include "follow.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "event.h"
+#include "history.h"
+#include "load.h"
+#include "matchIndex.h"
+#include "output.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+#include "save.h"
+#include "swap.h"
+
+/*** follow ***/
+// :follow keeps reading a file that another program appends to, like
+// tail -f. An inotify watch wakes the editor when the file is written, and
+// only the bytes past the last read offset are read and appended as rows.
+// The cursor stays on the last row. The buffer is read-only meanwhile, so
+// it always holds the file up to that offset.
+//
+// A log rotation renames or removes the file and creates a new one under
+// its name. The directory is watched for that name too, and when it names
+// another file than the one being read, that file is read from the start.
+#define FOLLOW_READ_BYTES (64 << 10)
+#define FOLLOW_FILE_EVENTS \
+  (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB)
+
+static struct {
+  int running;
+  int fd;       // The file, read with pread from offset
+  int inotify;  // Becomes readable when the file is written or replaced
+  int filewatch;
+  int dirwatch;
+  char *name;  // The name of the file in its directory
+  off_t offset;
+  int partial;  // The last row has not seen its newline yet
+  int truncated;
+} fl = {.fd = -1, .inotify = -1};
+
+// Appends a piece of a line; newline is set if the line ends after it.
+void followAppend(char *s, int len, int newline) {
+  if (fl.partial)
+    editorRowAppendString(editorRow(E.numrows - 1), s, len);
+  else
+    editorInsertRow(E.numrows, s, len);
+  fl.partial = !newline;
+  erow *row = editorRow(E.numrows - 1);
+  if (newline) {
+    int size = row->size;
+    while (size > 0 && editorRowCharAt(row, size - 1) == '\r') size--;
+    editorRowTruncate(row, size);
+  }
+}
+
+// Opens the file now under the name, if it is not the one being read.
+// Returns whether it did.
+int followReopen() {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st, old;
+  if (fstat(fd, &st) == -1 || (fstat(fl.fd, &old) == 0 &&
+                               st.st_dev == old.st_dev &&
+                               st.st_ino == old.st_ino)) {
+    close(fd);
+    return 0;
+  }
+  close(fl.fd);
+  fl.fd = fd;
+  inotify_rm_watch(fl.inotify, fl.filewatch);
+  fl.filewatch = inotify_add_watch(fl.inotify, E.filename, FOLLOW_FILE_EVENTS);
+  return 1;
+}
+
+void followRead(int fd) {
+  char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  int moved = 0;
+  while ((len = read(fd, events, sizeof(events))) > 0) {
+    char *p = events;
+    while (p < events + len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->wd == fl.dirwatch ? ev->len && !strcmp(ev->name, fl.name)
+                                : ev->mask & ~IN_MODIFY)
+        moved = 1;
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+  if (!fl.running) return;
+  int replaced = moved && followReopen();
+  struct stat st;
+  if (fstat(fl.fd, &st) == -1) return;
+  if (!replaced && st.st_size == fl.offset) return;
+  // Search workers read the rows in place, and appending may move them.
+  // A partial last line grows, so its matches go too, and a new file
+  // drops them all. The index is rebuilt below if a search is open.
+  int restart = replaced || st.st_size < fl.offset;
+  int from = fl.partial ? E.numrows - 1 : E.numrows;
+  editorMatchIndexInvalidate(restart ? 0 : from);
+  if (restart) {
+    // The old rows hold what the file had before, so the buffer starts
+    // over.
+    editorSetStatusMessage(replaced ? "%s: file replaced"
+                                    : "%s: file truncated",
+                           E.filename);
+    while (E.numrows > 0) editorDelRow(E.numrows - 1);
+    fl.offset = 0;
+    fl.partial = 0;
+    fl.truncated = 1;
+  }
+  static char buf[FOLLOW_READ_BYTES];
+  ssize_t n;
+  while ((n = pread(fl.fd, buf, sizeof(buf), fl.offset)) > 0) {
+    fl.offset += n;
+    char *p = buf;
+    char *end = buf + n;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      followAppend(p, (nl ? nl : end) - p, nl != NULL);
+      p = nl ? nl + 1 : end;
+    }
+  }
+  E.filesize = fl.offset;
+  E.dirty = 0;
+  E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  E.cx = COL_OFFSET;
+  editorMatchIndexUpdate();
+}
+
+void editorFollowStart() {
+  if (fl.running) return;
+  if (!E.filename || editorLoading()) {
+    editorSetStatusMessage("Nothing to follow yet");
+    return;
+  }
+  editorSaveWait();
+  if (E.dirty) {
+    editorSetStatusMessage("Save or undo the changes before following");
+    return;
+  }
+  fl.fd = open(E.filename, O_RDONLY);
+  if (fl.fd == -1) {
+    editorSetStatusMessage("Can't follow %s", E.filename);
+    return;
+  }
+  const char *slash = strrchr(E.filename, '/');
+  char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : NULL;
+  fl.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fl.inotify != -1) {
+    fl.filewatch =
+        inotify_add_watch(fl.inotify, E.filename, FOLLOW_FILE_EVENTS);
+    fl.dirwatch = inotify_add_watch(fl.inotify, dir ? dir : ".",
+                                    IN_CREATE | IN_MOVED_TO);
+  }
+  free(dir);
+  if (fl.inotify == -1 || fl.filewatch == -1 || fl.dirwatch == -1) {
+    if (fl.inotify != -1) close(fl.inotify);
+    fl.inotify = -1;
+    close(fl.fd);
+    fl.fd = -1;
+    editorSetStatusMessage("Can't follow %s", E.filename);
+    return;
+  }
+  // Rows borrowing from the mapping would fault once the file is
+  // truncated, and would keep a deleted file's blocks, so they move to
+  // the heap and the mapping goes.
+  editorUnmapRows();
+  fl.name = strdup(slash ? slash + 1 : E.filename);
+  fl.running = 1;
+  fl.truncated = 0;
+  fl.offset = E.filesize;
+  // A file that does not end in a newline is still writing its last line.
+  char last = '\n';
+  fl.partial = fl.offset > 0 && E.numrows > 0 &&
+               pread(fl.fd, &last, 1, fl.offset - 1) == 1 && last != '\n';
+  editorWatchFd(fl.inotify, followRead);
+  followRead(fl.inotify);
+  E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  E.cx = COL_OFFSET;
+  editorSetStatusMessage("Following %s, :nofollow to stop", E.filename);
+}
+
+void editorFollowStop() {
+  if (!fl.running) return;
+  editorUnwatchFd(fl.inotify);
+  close(fl.inotify);
+  close(fl.fd);
+  fl.inotify = fl.fd = -1;
+  free(fl.name);
+  fl.name = NULL;
+  fl.running = 0;
+  // The undo log no longer fits a buffer that started over, and the swap
+  // file has to start from the new content of the file.
+  if (fl.truncated) editorLoadUndoFile(E.filename);
+  editorSwapOpen(E.filename);
+  editorSetStatusMessage("Stopped following %s", E.filename);
+}
+
+int editorFollowing() { return fl.running; }
@@ -1,8 +1,16 @@
 #include "highlight.h"
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+#include "terminal.h"
 
 /*** filetypes ***/
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -30,117 +38,467 @@ int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+/*** keyword table ***/
+// A keyword matches where a word starts and is followed by a separator.
+// Keywords without separators can therefore only match the whole word, so
+// they are found with one hash lookup of the word. The few that contain a
+// separator, like "-rf", are compared one by one. When several keywords
+// match, the one listed first wins.
+struct keyword {
+  const char *word;
+  int len;
+  int order;
+  unsigned char hl;
+};
 
-  if (E.syntax == NULL) return;
+struct keywordTable {
+  struct keyword *slots;  // Open addressing; empty slots have no word
+  unsigned int mask;
+  struct keyword *spanning;  // Keywords that contain a separator
+  int nspanning;
+};
 
-  char **keywords = E.syntax->keywords;
+unsigned int keywordHash(const char *s, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+struct keyword *keywordFind(struct keywordTable *t, const char *s, int len) {
+  unsigned int i = keywordHash(s, len) & t->mask;
+  for (; t->slots[i].word; i = (i + 1) & t->mask) {
+    struct keyword *k = &t->slots[i];
+    if (k->len == len && !memcmp(k->word, s, len)) return k;
+  }
+  return NULL;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+struct keywordTable *keywordTableBuild(char **keywords) {
+  struct keywordTable *t = calloc(1, sizeof(*t));
+  int n = 0;
+  while (keywords[n]) n++;
+  unsigned int size = 8;
+  while (size < (unsigned int)n * 2) size *= 2;
+  t->slots = calloc(size, sizeof(struct keyword));
+  t->mask = size - 1;
+  t->spanning = malloc(sizeof(struct keyword) * (n ? n : 1));
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+  for (int j = 0; j < n; j++) {
+    struct keyword k = {keywords[j], strlen(keywords[j]), j, HL_KEYWORD1};
+    if (k.len && k.word[k.len - 1] == '|') {
+      k.len--;
+      k.hl = HL_KEYWORD2;
+    }
+    if (k.len == 0) continue;
+    int spanning = 0;
+    for (int i = 0; i < k.len; i++)
+      if (is_separator(k.word[i])) spanning = 1;
+    if (spanning) {
+      t->spanning[t->nspanning++] = k;
+    } else if (!keywordFind(t, k.word, k.len)) {
+      unsigned int i = keywordHash(k.word, k.len) & t->mask;
+      while (t->slots[i].word) i = (i + 1) & t->mask;
+      t->slots[i] = k;
+    }
+  }
+  return t;
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+// Returns the highlight of the keyword starting at text, or 0, and its
+// length in *klen.
+int keywordMatch(struct keywordTable *t, const char *text, int len,
+                 int *klen) {
+  int word = 0;
+  while (word < len && !is_separator(text[word])) word++;
+  struct keyword *best = word ? keywordFind(t, text, word) : NULL;
+  for (int j = 0; j < t->nspanning; j++) {
+    struct keyword *k = &t->spanning[j];
+    if (best && best->order < k->order) break;
+    if (k->len <= len && !memcmp(text, k->word, k->len) &&
+        (k->len == len || is_separator(text[k->len]))) {
+      best = k;
+      break;
+    }
+  }
+  if (!best) return 0;
+  *klen = best->len;
+  return best->hl;
+}
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
+/*** syntax machine ***/
+// Each syntax is compiled into a state machine. Bytes that behave the same
+// in every state share a class, and the transition table says for each
+// state and class how to highlight the byte and which state follows. The
+// syntax flags and delimiters are folded into the tables, so highlighting
+// only looks up transitions. Comment delimiters, keywords and escapes,
+// which span several bytes, are handled by an action on their first byte.
+#define SYNTAX_MAX_QUOTES 4
+
+enum syntaxState {
+  ST_SEP = 0,  // After a separator, where keywords and numbers may start
+  ST_WORD,
+  ST_NUMBER,
+  ST_MLCOMMENT,
+  ST_STRING,  // One state per quote character
+  ST_STATES = ST_STRING + SYNTAX_MAX_QUOTES
+};
+
+enum syntaxAction {
+  ACT_PAINT = 0,
+  ACT_DELIM,        // Try the comment starts, else use the plain class
+  ACT_KEYWORD,      // Try the keywords, else paint
+  ACT_ESCAPE,       // Paint the byte and the next one
+  ACT_COMMENT_END,  // Try the multi-line comment end, else paint
+};
+
+struct transition {
+  unsigned char action;
+  unsigned char hl;
+  unsigned char next;
+};
+
+struct syntaxMachine {
+  unsigned char cls[256];
+  unsigned char plain[256];  // Class of a byte that starts no comment
+  int nclasses;
+  struct transition *table;  // Indexed by state * nclasses + class
+  struct keywordTable *keywords;
+  const char *scs, *mcs, *mce;
+  int scs_len, mcs_len, mce_len;
+};
+
+struct transition syntaxStep(struct syntaxMachine *m, int numbers,
+                             const char *quotes, const unsigned char *kwstart,
+                             int state, int c, int delims) {
+  int sep = is_separator(c);
+  const char *q = c ? strchr(quotes, c) : NULL;
+  int multiline = m->mcs_len && m->mce_len;
+
+  if (state == ST_MLCOMMENT) {
+    if (multiline && c == (unsigned char)m->mce[0])
+      return (struct transition){ACT_COMMENT_END, HL_MLCOMMENT, ST_MLCOMMENT};
+    return (struct transition){ACT_PAINT, HL_MLCOMMENT, ST_MLCOMMENT};
+  }
+  if (state >= ST_STRING) {
+    if (c == '\\') return (struct transition){ACT_ESCAPE, HL_STRING, state};
+    if (c == (unsigned char)quotes[state - ST_STRING])
+      return (struct transition){ACT_PAINT, HL_STRING, ST_SEP};
+    return (struct transition){ACT_PAINT, HL_STRING, state};
+  }
+  if (delims && ((m->scs_len && c == (unsigned char)m->scs[0]) ||
+                 (multiline && c == (unsigned char)m->mcs[0])))
+    return (struct transition){ACT_DELIM, HL_NORMAL, state};
+  if (q)
+    return (struct transition){ACT_PAINT, HL_STRING, ST_STRING + q - quotes};
+  if (numbers && ((isdigit(c) && state != ST_WORD) ||
+                  (c == '.' && state == ST_NUMBER)))
+    return (struct transition){ACT_PAINT, HL_NUMBER, ST_NUMBER};
+  int next = sep ? ST_SEP : ST_WORD;
+  if (state == ST_SEP && kwstart[c])
+    return (struct transition){ACT_KEYWORD, HL_NORMAL, next};
+  return (struct transition){ACT_PAINT, HL_NORMAL, next};
+}
+
+// Returns the class whose transitions are column, adding it if it is new.
+int syntaxClass(struct syntaxMachine *m, struct transition *columns,
+                struct transition *column) {
+  for (int k = 0; k < m->nclasses; k++)
+    if (!memcmp(&columns[k * ST_STATES], column,
+                sizeof(struct transition) * ST_STATES))
+      return k;
+  memcpy(&columns[m->nclasses * ST_STATES], column,
+         sizeof(struct transition) * ST_STATES);
+  return m->nclasses++;
+}
+
+struct syntaxMachine *syntaxCompile(struct editorSyntax *s) {
+  struct syntaxMachine *m = calloc(1, sizeof(*m));
+  m->keywords = keywordTableBuild(s->keywords);
+  m->scs = s->singleline_comment_start;
+  m->mcs = s->multiline_comment_start;
+  m->mce = s->multiline_comment_end;
+  m->scs_len = m->scs ? strlen(m->scs) : 0;
+  m->mcs_len = m->mcs ? strlen(m->mcs) : 0;
+  m->mce_len = m->mce ? strlen(m->mce) : 0;
+
+  char quotes[SYNTAX_MAX_QUOTES + 1] = "";
+  if (s->flags & HL_HIGHLIGHT_STRINGS)
+    strncat(quotes, s->quotes ? s->quotes : "\"'", SYNTAX_MAX_QUOTES);
+  int numbers = s->flags & HL_HIGHLIGHT_NUMBERS;
+  unsigned char kwstart[256] = {0};
+  for (int j = 0; s->keywords[j]; j++)
+    kwstart[(unsigned char)s->keywords[j][0]] = 1;
+
+  // Each byte has a column of transitions, one per state. Bytes with
+  // equal columns share a class.
+  struct transition *columns = malloc(sizeof(struct transition) * ST_STATES *
+                                      256 * 2);
+  struct transition column[ST_STATES];
+  for (int c = 0; c < 256; c++) {
+    for (int delims = 1; delims >= 0; delims--) {
+      for (int state = 0; state < ST_STATES; state++)
+        column[state] = syntaxStep(m, numbers, quotes, kwstart, state, c,
+                                   delims);
+      int k = syntaxClass(m, columns, column);
+      if (delims) m->cls[c] = k;
+      m->plain[c] = k;
     }
+  }
+  m->table = malloc(sizeof(struct transition) * ST_STATES * m->nclasses);
+  for (int state = 0; state < ST_STATES; state++)
+    for (int k = 0; k < m->nclasses; k++)
+      m->table[state * m->nclasses + k] = columns[k * ST_STATES + state];
+  free(columns);
+  return m;
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
+// Highlights len bytes of text into hl, starting inside a multi-line comment
+// if in_comment is set. Returns whether a comment is still open at the end.
+int syntaxHighlightLine(struct syntaxMachine *m, const char *text, int len,
+                        unsigned char *hl, int in_comment) {
+  int state = in_comment && m->mcs_len && m->mce_len ? ST_MLCOMMENT : ST_SEP;
+  int i = 0;
+  while (i < len) {
+    unsigned char c = text[i];
+    struct transition t = m->table[state * m->nclasses + m->cls[c]];
+    if (t.action == ACT_DELIM) {
+      if (m->scs_len && i + m->scs_len <= len &&
+          !memcmp(&text[i], m->scs, m->scs_len)) {
+        memset(&hl[i], HL_COMMENT, len - i);
+        return 0;
+      }
+      if (m->mcs_len && m->mce_len && i + m->mcs_len <= len &&
+          !memcmp(&text[i], m->mcs, m->mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, m->mcs_len);
+        i += m->mcs_len;
+        state = ST_MLCOMMENT;
         continue;
       }
+      t = m->table[state * m->nclasses + m->plain[c]];
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
+    int n = 1;
+    switch (t.action) {
+      case ACT_KEYWORD: {
+        int kw = keywordMatch(m->keywords, &text[i], len - i, &n);
+        if (kw) {
+          t.hl = kw;
+          t.next = ST_WORD;
+        } else {
+          n = 1;
         }
+        break;
       }
+      case ACT_ESCAPE:
+        if (i + 1 < len) n = 2;
+        break;
+      case ACT_COMMENT_END:
+        if (i + m->mce_len <= len && !memcmp(&text[i], m->mce, m->mce_len)) {
+          n = m->mce_len;
+          t.next = ST_SEP;
+        }
+        break;
     }
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
+    memset(&hl[i], t.hl, n);
+    i += n;
+    state = t.next;
+  }
+  return state == ST_MLCOMMENT;
+}
+
+int editorHighlightLine(char *text, int len, unsigned char *hl,
+                        int in_comment) {
+  if (E.syntax == NULL) {
+    memset(hl, HL_NORMAL, len);
+    return 0;
+  }
+  return syntaxHighlightLine(E.syntax->machine, text, len, hl, in_comment);
+}
+
+void editorUpdateSyntax(erow *row, int in_comment) {
+  row->hl = realloc(row->hl, row->rsize);
+  row->hl_open_comment =
+      editorHighlightLine(row->render, row->rsize, row->hl, in_comment);
+  // Only a window of a long row is highlighted, so its end state is unknown.
+  // Multi-line comments are not carried across such rows.
+  if (row->rwindow) row->hl_open_comment = in_comment;
+  row->hl_in = in_comment;
+}
+
+/*** background highlighting ***/
+// The comment state of the rows past the frontier is found by a worker
+// thread, a chunk of rows at a time, so that jumping far into a large file
+// does not scan every row in between first. The worker runs on a copy of
+// the chunk. Edits above the end of the chunk bump hl_version, and a
+// result taken from an older version is dropped rather than applied.
+#define HL_CHUNK_ROWS 16384
+#define HL_CHUNK_BYTES (1 << 20)
+#define HL_SYNC_ROWS 1024  // Shorter gaps to the frontier are scanned inline
+
+struct highlightJob {
+  pthread_t thread;
+  int running;
+  unsigned int version;
+  struct syntaxMachine *machine;
+  int from;
+  int to;
+  int in;  // Comment state entering row from
+  char *text;
+  int text_cap;
+  int *offset;
+  int *size;  // -1 for long rows, which never carry a comment state
+  int *hl_in;
+  unsigned char *open;  // Comment state of each row, as hl_open_comment
+  int rows_cap;
+  unsigned char *scratch;
+  int scratch_len;
+  int notify[2];
+};
+
+static struct highlightJob hl_job = {.notify = {-1, -1}};
+static unsigned int hl_version = 0;
+
+void *highlightJobRun(void *arg) {
+  struct highlightJob *job = arg;
+  int in = job->in;
+  for (int i = 0; i < job->to - job->from; i++) {
+    char *text = &job->text[job->offset[i]];
+    if (job->size[i] < 0)
+      job->open[i] = in;
+    else if (job->hl_in[i] != in)
+      job->open[i] = syntaxHighlightLine(job->machine, text, job->size[i],
+                                         job->scratch, in);
+    in = job->open[i];
+  }
+  write(job->notify[1], "", 1);
+  return NULL;
+}
+
+void highlightJobCollect(int fd);
+
+// Copies the rows from the frontier on and hands them to the worker.
+void highlightJobStart() {
+  struct highlightJob *job = &hl_job;
+  if (job->running || !E.syntax || E.hl_frontier >= E.numrows) return;
+  if (job->notify[0] == -1) {
+    if (pipe(job->notify) == -1) die("pipe");
+    fcntl(job->notify[0], F_SETFL, O_NONBLOCK);
+    editorWatchFd(job->notify[0], highlightJobCollect);
+  }
+
+  job->from = E.hl_frontier;
+  job->in = job->from > 0 ? editorRow(job->from - 1)->hl_open_comment : 0;
+  int len = 0, scratch = 0, i = 0;
+  for (int at = job->from; at < E.numrows && i < HL_CHUNK_ROWS; at++, i++) {
+    if (len >= HL_CHUNK_BYTES) break;
+    erow *row = editorRow(at);
+    if (i == job->rows_cap) {
+      job->rows_cap = job->rows_cap ? job->rows_cap * 2 : 1024;
+      job->offset = realloc(job->offset, sizeof(int) * job->rows_cap);
+      job->size = realloc(job->size, sizeof(int) * job->rows_cap);
+      job->hl_in = realloc(job->hl_in, sizeof(int) * job->rows_cap);
+      job->open = realloc(job->open, job->rows_cap);
+    }
+    job->offset[i] = len;
+    job->hl_in[i] = row->hl_in;
+    job->open[i] = row->hl_open_comment;
+    if (row->size >= AVI_LONG_LINE) {
+      job->size[i] = -1;
+      continue;
+    }
+    job->size[i] = row->size;
+    if (len + row->size > job->text_cap) {
+      job->text_cap = (len + row->size) * 2;
+      job->text = realloc(job->text, job->text_cap);
     }
+    memcpy(&job->text[len], editorRowChars(row), row->size);
+    len += row->size;
+    if (row->size > scratch) scratch = row->size;
+  }
+  job->to = job->from + i;
+  if (scratch > job->scratch_len) {
+    job->scratch_len = scratch;
+    job->scratch = realloc(job->scratch, scratch);
+  }
+  job->machine = E.syntax->machine;
+  job->version = hl_version;
+  // Without a thread the frontier is only advanced while drawing.
+  job->running = !pthread_create(&job->thread, NULL, highlightJobRun, job);
+  if (!job->running) job->to = 0;
+}
 
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
-      }
+// Applies a finished chunk on the main thread and starts the next one.
+void highlightJobCollect(int fd) {
+  struct highlightJob *job = &hl_job;
+  char buf[16];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  if (!job->running) return;
+  pthread_join(job->thread, NULL);
+  job->running = 0;
+
+  if (job->version == hl_version) {
+    int in = job->in;
+    for (int i = 0; i < job->to - job->from; i++) {
+      erow *row = editorRow(job->from + i);
+      if (row->hl_in != in) row->hl_in = -1;
+      row->hl_open_comment = job->open[i];
+      in = job->open[i];
     }
+    if (E.hl_frontier < job->to) E.hl_frontier = job->to;
+  }
+  job->to = 0;
+  highlightJobStart();
+}
+
+// Called whenever row at changes or rows are inserted or deleted at at.
+// Rows from at onwards may now start in a different comment state.
+void editorInvalidateSyntax(int at) {
+  if (at < E.hl_frontier) E.hl_frontier = at;
+  if (at < hl_job.to) hl_version++;
+}
 
-    prev_sep = is_separator(c);
-    i++;
+// Makes hl_open_comment of the row at E.hl_frontier correct and advances the
+// frontier past it. Rows whose hl was built from the same comment state are
+// skipped without rescanning, others are scanned without keeping their hl.
+void editorAdvanceSyntaxFrontier() {
+  static unsigned char *scratch = NULL;
+  static int scratch_len = 0;
+
+  erow *row = editorRow(E.hl_frontier);
+  int in = E.hl_frontier > 0 ? editorRow(E.hl_frontier - 1)->hl_open_comment
+                             : 0;
+  if (row->size >= AVI_LONG_LINE) {
+    row->hl_open_comment = in;
+  } else if (row->hl_in != in) {
+    row->hl_in = -1;
+    if (row->size > scratch_len) {
+      scratch_len = row->size;
+      scratch = realloc(scratch, scratch_len);
+    }
+    row->hl_open_comment =
+        editorHighlightLine(editorRowChars(row), row->size, scratch, in);
   }
+  E.hl_frontier++;
+}
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+// Highlights the rows [from, to) that are about to be drawn. Only rows that
+// changed, or whose incoming comment state changed, are rescanned.
+void editorHighlightRows(int from, int to) {
+  if (to > E.numrows) to = E.numrows;
+  highlightJobStart();
+  // Far past the frontier, rows are drawn from the comment state the row
+  // above had last. The worker resets the rows it finds were wrong, and
+  // they are highlighted again on the next refresh.
+  if (!hl_job.running || from - E.hl_frontier <= HL_SYNC_ROWS)
+    while (E.hl_frontier < from) editorAdvanceSyntaxFrontier();
+  for (int filerow = from; filerow < to; filerow++) {
+    erow *row = editorRow(filerow);
+    int in = filerow > 0 ? editorRow(filerow - 1)->hl_open_comment : 0;
+    editorPrepareRow(row);
+    if (row->hl_in != in) editorUpdateSyntax(row, in);
+    if (filerow == E.hl_frontier) E.hl_frontier++;
+  }
 }
 
 int editorSyntaxToColor(int hl) {
@@ -163,25 +521,41 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
+// Syntaxes loaded from definition files, searched before HLDB so that a
+// file can replace a built-in syntax.
+static struct editorSyntax **loaded = NULL;
+static int nloaded = 0;
+
+void editorAddSyntax(struct editorSyntax *s) {
+  loaded = realloc(loaded, sizeof(struct editorSyntax *) * (nloaded + 1));
+  loaded[nloaded++] = s;
+}
+
+int syntaxMatchesFile(struct editorSyntax *s, char *filename) {
+  char *ext = strrchr(filename, '.');
+  for (unsigned int i = 0; s->filematch[i]; i++) {
+    int is_ext = (s->filematch[i][0] == '.');
+    if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+        (!is_ext && strstr(filename, s->filematch[i])))
+      return 1;
+  }
+  return 0;
+}
+
 void editorSelectSyntaxHighlight() {
   E.syntax = NULL;
+  hl_version++;
   if (E.filename == NULL) return;
-  char *ext = strrchr(E.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
-        return;
-      }
-      i++;
-    }
-  }
+  struct editorSyntax *s = NULL;
+  for (int j = nloaded - 1; j >= 0 && !s; j--)
+    if (syntaxMatchesFile(loaded[j], E.filename)) s = loaded[j];
+  for (unsigned int j = 0; j < HLDB_ENTRIES && !s; j++)
+    if (syntaxMatchesFile(&HLDB[j], E.filename)) s = &HLDB[j];
+  if (!s) return;
+
+  E.syntax = s;
+  if (!s->machine) s->machine = syntaxCompile(s);
+  for (int filerow = 0; filerow < E.numrows; filerow++)
+    editorRow(filerow)->hl_in = -1;
+  E.hl_frontier = 0;
 }
@@ -1,65 +1,747 @@
 #include "history.h"
 
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "definitions.h"
 #include "input.h"
 #include "output.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+#include "swap.h"
+
+/*** undo log ***/
+// Edits are recorded as operations in one log: text inserted or deleted at
+// a position, where a newline splits or joins rows, rows inserted or
+// deleted whole, and rows rewritten by a command. Their text is kept in one
+// byte arena. Undo walks back through the log and redo forward, so a new
+// edit after undo drops the ops past that point.
+//
+// Ops recorded between two closeUndoGroup calls form a group, undone in
+// one step. Typing extends the last insert and backspace shrinks it, so a
+// long insert is one op whose text grows with the edit.
+//
+// Ops read back from an undo file keep their text in the mapped file.
+enum undoKind { OP_INSERT, OP_DELETE, OP_INSERT_ROW, OP_DELETE_ROW, OP_ROWS };
+
+struct undoOp {
+  unsigned char kind;
+  unsigned char reversed;  // Text is stored back to front, grown by backspace
+  unsigned char mapped;    // Text is in the undo file rather than the arena
+  int group;
+  int y;
+  int x;
+  int ey;  // End of inserted text, where typing continues it
+  int ex;
+  size_t off;  // Text in the arena or the undo file
+  int len;
+  struct rowText *rows;
+  int nrows;
+};
+
+static struct undoOp *ops = NULL;
+static int nops = 0;
+static int opscap = 0;
+static int undo_at = 0;  // Ops before this are applied, the rest are redo
+static char *arena = NULL;
+static size_t arenalen = 0;
+static size_t arenacap = 0;
+static int group = 0;
+static int group_open = 0;
+static int replaying = 0;  // Set while undo and redo edit the rows
+static int journaled = 0;  // Leading ops whose current state is on disk
+static int marked = 0;     // Leading ops unchanged since editorUndoMark
+static char *journal_map = NULL;
+static size_t journal_maplen = 0;
 
-void addUndo(char c) {
-  if (E.undo_level.level >= MAX_HISTORY) {
-    E.undo_level.level = 0;
-    E.undo_level.wraps++;
-  };
+void freeRowTexts(struct rowText *rows, int nrows) {
+  for (int i = 0; i < nrows; i++) free(rows[i].text);
+  free(rows);
+}
 
-  undo_history[E.undo_level.level].c = c;
-  undo_history[E.undo_level.level].uy = E.cy;
-  undo_history[E.undo_level.level].ux = E.cx;
-  undo_history[E.undo_level.level].end = 0;
-  E.undo_level.level++;
+// Swaps the saved texts with the current ones, so the same list undoes a
+// bulk rewrite and then redoes it.
+void swapRowTexts(struct rowText *rows, int nrows) {
+  for (int i = 0; i < nrows; i++)
+    editorRowSwapText(editorRow(rows[i].at), &rows[i].text, &rows[i].len);
 }
 
-void addRedo(char c) {
-  if (E.redo_level.level >= MAX_HISTORY) {
-    E.redo_level.level = 0;
-    E.redo_level.wraps++;
+void arenaAppend(const char *s, int len) {
+  if (arenalen + len > arenacap) {
+    arenacap = arenacap ? arenacap * 2 : 4096;
+    while (arenacap < arenalen + len) arenacap *= 2;
+    arena = realloc(arena, arenacap);
   }
+  memcpy(&arena[arenalen], s, len);
+  arenalen += len;
+}
 
-  redo_history[E.redo_level.level].c = c;
-  redo_history[E.redo_level.level].uy = E.cy;
-  redo_history[E.redo_level.level].ux = E.cx;
-  redo_history[E.redo_level.level].end = 0;
-  E.redo_level.level++;
+// Where text s inserted at (y, x) ends.
+void undoTextEnd(int y, int x, const char *s, int len, int *ey, int *ex) {
+  *ey = y;
+  *ex = x;
+  for (int i = 0; i < len; i++) {
+    if (s[i] == '\n') {
+      (*ey)++;
+      *ex = COL_OFFSET;
+    } else {
+      (*ex)++;
+    }
+  }
+}
+
+// Returns the last op if the next one may be merged into it.
+struct undoOp *undoLastOp(int kind) {
+  if (!group_open || nops == 0 || undo_at != nops) return NULL;
+  struct undoOp *last = &ops[nops - 1];
+  if (last->kind != kind || last->group != group || last->mapped) return NULL;
+  return last;
+}
+
+// Marks ops from index on as changed since they were written to disk.
+void undoChanged(int index) {
+  if (journaled > index) journaled = index;
+  if (marked > index) marked = index;
+}
+
+struct undoOp *addUndoOp(int kind, int y, int x) {
+  if (replaying) return NULL;
+  for (int i = undo_at; i < nops; i++) freeRowTexts(ops[i].rows, ops[i].nrows);
+  if (undo_at < nops) arenalen = ops[undo_at].mapped ? 0 : ops[undo_at].off;
+  nops = undo_at;
+  undoChanged(nops);
+  if (!group_open) {
+    group++;
+    group_open = 1;
+  }
+  if (nops == opscap) {
+    opscap = opscap ? opscap * 2 : 256;
+    ops = realloc(ops, sizeof(struct undoOp) * opscap);
+  }
+  struct undoOp *op = &ops[nops++];
+  memset(op, 0, sizeof(*op));
+  op->kind = kind;
+  op->group = group;
+  op->y = op->ey = y;
+  op->x = op->ex = x;
+  op->off = arenalen;
+  undo_at = nops;
+  return op;
+}
+
+// Ends the current group; the next edit starts a new undo step.
+void closeUndoGroup() { group_open = 0; }
+
+void addUndoInsert(int y, int x, const char *s, int len) {
+  if (replaying) return;
+  editorSwapChange(SWAP_INSERT, y, x, s, len);
+  struct undoOp *op = undoLastOp(OP_INSERT);
+  if (!op || op->ey != y || op->ex != x)
+    op = addUndoOp(OP_INSERT, y, x);
+  else
+    undoChanged(nops - 1);
+  arenaAppend(s, len);
+  op->len += len;
+  undoTextEnd(op->ey, op->ex, s, len, &op->ey, &op->ex);
+}
+
+void addUndoDelete(int y, int x, const char *s, int len) {
+  if (replaying) return;
+  editorSwapChange(SWAP_DELETE, y, x, s, len);
+  int ey, ex;
+  undoTextEnd(y, x, s, len, &ey, &ex);
+  // Backspace over text just typed takes it back out of the insert.
+  struct undoOp *op = undoLastOp(OP_INSERT);
+  if (op && len == 1 && op->ey == ey && op->ex == ex) {
+    undoChanged(nops - 1);
+    op->len--;
+    arenalen--;
+    if (op->len == 0)
+      nops = undo_at = nops - 1;
+    else if (s[0] == '\n')
+      undoTextEnd(op->y, op->x, &arena[op->off], op->len, &op->ey, &op->ex);
+    else
+      op->ex--;
+    return;
+  }
+  // A run of deletes at one place, or of backspaces, grows one op.
+  op = undoLastOp(OP_DELETE);
+  if (op && len == 1) {
+    if (!op->reversed && op->y == y && op->x == x) {
+      undoChanged(nops - 1);
+      arenaAppend(s, 1);
+      op->len++;
+      return;
+    }
+    if ((op->reversed || op->len == 1) && op->y == ey && op->x == ex) {
+      undoChanged(nops - 1);
+      arenaAppend(s, 1);
+      op->len++;
+      op->reversed = 1;
+      op->y = y;
+      op->x = x;
+      return;
+    }
+  }
+  op = addUndoOp(OP_DELETE, y, x);
+  arenaAppend(s, len);
+  op->len = len;
+}
+
+void addUndoInsertRow(int at) {
+  if (replaying) return;
+  editorSwapChange(SWAP_INSERT_ROW, at, COL_OFFSET, "", 0);
+  addUndoOp(OP_INSERT_ROW, at, COL_OFFSET);
+}
+
+void addUndoDeleteRow(int at, const char *s, int len) {
+  if (replaying) return;
+  editorSwapChange(SWAP_DELETE_ROW, at, COL_OFFSET, "", 0);
+  struct undoOp *op = addUndoOp(OP_DELETE_ROW, at, COL_OFFSET);
+  arenaAppend(s, len);
+  op->len = len;
+}
+
+// Logs the current text of each row to the swap file.
+void swapRowsChanged(struct rowText *rows, int nrows) {
+  for (int i = 0; i < nrows; i++) {
+    erow *row = editorRow(rows[i].at);
+    editorSwapChange(SWAP_SET_ROW, rows[i].at, COL_OFFSET,
+                     editorRowChars(row), row->size);
+  }
+}
+
+// Records rows rewritten by a command, as one step. The list holds the old
+// texts and is owned by the log from now on.
+void addUndoRows(int y, int x, struct rowText *rows, int nrows) {
+  swapRowsChanged(rows, nrows);
+  closeUndoGroup();
+  struct undoOp *op = addUndoOp(OP_ROWS, y, x);
+  op->rows = rows;
+  op->nrows = nrows;
+  closeUndoGroup();
+}
+
+// Returns the text of op front to back.
+char *undoOpText(struct undoOp *op) {
+  static char *buf = NULL;
+  static int bufcap = 0;
+  char *text = op->mapped ? &journal_map[op->off] : &arena[op->off];
+  if (!op->reversed) return text;
+  if (op->len > bufcap) {
+    bufcap = op->len;
+    buf = realloc(buf, bufcap);
+  }
+  for (int i = 0; i < op->len; i++)
+    buf[i] = text[op->len - 1 - i];
+  return buf;
+}
+
+void undoInsertText(int y, int x, char *s, int len) {
+  E.cy = y;
+  E.cx = x;
+  editorInsertText(s, len);
+}
+
+// Returns whether text taken out at column x of row y is still there to
+// take. Ops read from an undo file were only checked against the row
+// count, and one that was damaged may not fit the rows it edits.
+int undoTextFits(int y, int x, char *s, int len, int insert) {
+  int at = x - COL_OFFSET;
+  if (at > editorRow(y)->size) return 0;
+  if (insert) return 1;
+  int lines = 0;
+  int last = at + len;  // Where the text ends in its last row
+  for (int i = 0; i < len; i++) {
+    if (s[i] == '\n') {
+      lines++;
+      last = len - i - 1;
+    }
+  }
+  return last <= editorRow(y + lines)->size;
+}
+
+// Applies op, or reverts it if undo is set. The swap file logs the change
+// it makes like any other edit. Returns 0, changing nothing, if the op
+// does not fit the text.
+int undoOpApply(struct undoOp *op, int undo) {
+  char *text = undoOpText(op);
+  int insert = (op->kind == OP_INSERT || op->kind == OP_INSERT_ROW) != undo;
+  switch (op->kind) {
+    case OP_INSERT:
+    case OP_DELETE:
+      if (!undoTextFits(op->y, op->x, text, op->len, insert)) return 0;
+      editorSwapChange(insert ? SWAP_INSERT : SWAP_DELETE, op->y, op->x, text,
+                       op->len);
+      if (insert)
+        undoInsertText(op->y, op->x, text, op->len);
+      else
+        editorDeleteText(op->y, op->x, text, op->len);
+      break;
+    case OP_INSERT_ROW:
+    case OP_DELETE_ROW:
+      if (insert) {
+        editorSwapChange(SWAP_INSERT_ROW, op->y, COL_OFFSET, text, op->len);
+        editorInsertRow(op->y, text, op->len);
+      } else {
+        editorSwapChange(SWAP_DELETE_ROW, op->y, COL_OFFSET, "", 0);
+        editorDelRow(op->y);
+      }
+      break;
+    case OP_ROWS:
+      // The list now holds the other texts, so it has to be written again.
+      swapRowTexts(op->rows, op->nrows);
+      swapRowsChanged(op->rows, op->nrows);
+      undoChanged(op - ops);
+      break;
+  }
+  return 1;
+}
+
+void undoDiscard();
+
+void undoClampCursor(int y, int x) {
+  E.cy = y < E.numrows ? y : E.numrows;
+  int size = E.cy < E.numrows ? editorRow(E.cy)->size : 0;
+  E.cx = x - COL_OFFSET <= size ? x : size + COL_OFFSET;
 }
 
 void doUndo() {
-  if (E.undo_level.level <= 0 && E.undo_level.wraps <= 0) return;
-  if (E.undo_level.level <= 0 && E.undo_level.wraps > 0) {
-    E.undo_level.level = MAX_HISTORY;
-    E.undo_level.wraps = 0;
-  }
-  E.undo_level.level--;
-  if (undo_history[E.undo_level.level].end == 1) return;
-  undo_history[E.undo_level.level].end = 1;
-  editorSetStatusMessage("level %d, wraps: %d", E.undo_level.level,
-                         E.undo_level.wraps);
-  E.cy = undo_history[E.undo_level.level].uy;
-  E.cx = undo_history[E.undo_level.level].ux;
-  char toRemove = E.row[E.cy].chars[E.cx - COL_OFFSET - 1];
-  editorDelChar();
-  addRedo(toRemove);
+  closeUndoGroup();
+  if (undo_at == 0) {
+    editorSetStatusMessage("Already at oldest change");
+    return;
+  }
+  replaying = 1;
+  int g = ops[undo_at - 1].group;
+  while (undo_at > 0 && ops[undo_at - 1].group == g) {
+    if (!undoOpApply(&ops[undo_at - 1], 1)) {
+      undoDiscard();
+      return;
+    }
+    undo_at--;
+  }
+  replaying = 0;
+  undoClampCursor(ops[undo_at].y, ops[undo_at].x);
+  editorSetStatusMessage("Undo");
 }
 
 void doRedo() {
-  if (E.redo_level.level <= 0 && E.redo_level.wraps <= 0) return;
-  if (E.redo_level.level <= 0 && E.redo_level.wraps > 0) {
-    E.redo_level.level = MAX_HISTORY;
-    E.redo_level.wraps = 0;
-  }
-  E.redo_level.level--;
-  if (redo_history[E.redo_level.level].end == 1) return;
-  redo_history[E.redo_level.level].end = 1;
-  E.cy = redo_history[E.redo_level.level].uy;
-  E.cx = redo_history[E.redo_level.level].ux;
-  char toInsert = redo_history[E.redo_level.level].c;
-  editorInsertChar(toInsert);
-  addUndo(toInsert);
+  closeUndoGroup();
+  if (undo_at == nops) {
+    editorSetStatusMessage("Already at newest change");
+    return;
+  }
+  replaying = 1;
+  int g = ops[undo_at].group;
+  int first = undo_at;
+  while (undo_at < nops && ops[undo_at].group == g) {
+    if (!undoOpApply(&ops[undo_at], 0)) {
+      undoDiscard();
+      return;
+    }
+    undo_at++;
+  }
+  replaying = 0;
+  undoClampCursor(ops[first].y, ops[first].x);
+  editorSetStatusMessage("Redo");
+}
+
+/*** undo file ***/
+// The log is kept in .<name>.avi-undo next to the file. It is a header and
+// a list of records: an op record stores the op at some index and drops any
+// ops after it, and a save record holds the log position and the size and
+// content hash of the file as it was saved. Each save appends the ops that
+// changed since the last one and a save record, and rewrites the file from
+// scratch once it holds mostly dropped ops.
+//
+// On open the file is mapped and its records are read up to the last save
+// record. The log is restored only if the file still has that content
+// and every op lands on rows the buffer has when it is undone or redone.
+#define UNDO_MAGIC "AVIUNDO1"
+
+enum { UNDO_RECORD_OP = 1, UNDO_RECORD_SAVE };
+
+struct undoRecord {
+  uint32_t type;
+  uint32_t size;  // Bytes that follow, padded to 8
+};
+
+struct undoOpRecord {
+  int32_t index;
+  int32_t kind;
+  int32_t reversed;
+  int32_t group;
+  int32_t y, x, ey, ex;
+  int32_t len;
+  int32_t nrows;  // Followed by nrows (at, len) pairs, the text, row texts
+};
+
+struct undoSaveRecord {
+  uint64_t hash;
+  uint64_t size;
+  int32_t nops;
+  int32_t undo_at;
+  int32_t group;
+  int32_t pad;
+};
+
+static char *journal_path = NULL;
+static int journal_records = 0;  // Op records in the file
+
+// Returns the path of a hidden file kept next to filename, like
+// .<name>.avi-undo for the suffix "undo".
+char *editorSideFilePath(const char *filename, const char *suffix) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + strlen(suffix) + 8);
+  sprintf(path, "%.*s.%s.avi-%s", dirlen, filename, filename + dirlen, suffix);
+  return path;
+}
+
+// Only has to tell whether the file changed, so it mixes 8 bytes at a time.
+// The content can be fed in pieces of any size, as a save writes it.
+void editorHashInit(struct contentHash *c, uint64_t len) {
+  c->h = 14695981039346656037ULL ^ len;
+  c->ntail = 0;
+}
+
+void hashWord(struct contentHash *c, const char *p) {
+  uint64_t w;
+  memcpy(&w, p, 8);
+  c->h = (c->h ^ w) * 1099511628211ULL;
+  c->h ^= c->h >> 32;
+}
+
+void editorHashUpdate(struct contentHash *c, const char *p, size_t len) {
+  if (c->ntail) {
+    size_t n = 8 - c->ntail < len ? 8 - c->ntail : len;
+    memcpy(&c->tail[c->ntail], p, n);
+    c->ntail += n;
+    p += n;
+    len -= n;
+    if (c->ntail < 8) return;
+    hashWord(c, c->tail);
+    c->ntail = 0;
+  }
+  for (; len >= 8; p += 8, len -= 8) hashWord(c, p);
+  memcpy(c->tail, p, len);
+  c->ntail = len;
+}
+
+uint64_t editorHashFinal(struct contentHash *c) {
+  for (int i = 0; i < c->ntail; i++)
+    c->h = (c->h ^ (unsigned char)c->tail[i]) * 1099511628211ULL;
+  return c->h;
+}
+
+uint64_t editorContentHash(const char *p, size_t len) {
+  struct contentHash c;
+  editorHashInit(&c, len);
+  editorHashUpdate(&c, p, len);
+  return editorHashFinal(&c);
+}
+
+// Hashes the current content of a file. Returns 0 if it cannot be read.
+int editorHashFile(const char *filename, uint64_t *size, uint64_t *hash) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  int ok = fstat(fd, &st) == 0;
+  if (ok) {
+    *size = st.st_size;
+    *hash = editorContentHash(NULL, 0);
+  }
+  if (ok && st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = map != MAP_FAILED;
+    if (ok) {
+      *hash = editorContentHash(map, st.st_size);
+      munmap(map, st.st_size);
+    }
+  }
+  close(fd);
+  return ok;
+}
+
+
+void undoRecordPut(struct abuf *b, int type, const void *data, int len) {
+  struct undoRecord rec = {type, (len + 7) & ~7};
+  static const char zero[8];
+  abAppend(b, (const char *)&rec, sizeof(rec));
+  abAppend(b, data, len);
+  abAppend(b, zero, rec.size - len);
+}
+
+void undoOpPut(struct abuf *b, int index) {
+  struct undoOp *op = &ops[index];
+  struct undoOpRecord r = {index, op->kind, op->reversed, op->group, op->y,
+                           op->x, op->ey, op->ex, op->len, op->nrows};
+  struct abuf rec = ABUF_INIT;
+  abAppend(&rec, (const char *)&r, sizeof(r));
+  for (int i = 0; i < op->nrows; i++) {
+    int32_t pair[2] = {op->rows[i].at, op->rows[i].len};
+    abAppend(&rec, (const char *)pair, sizeof(pair));
+  }
+  // Reversed text is written as stored, and read back the same way.
+  abAppend(&rec, op->mapped ? &journal_map[op->off] : &arena[op->off],
+           op->len);
+  for (int i = 0; i < op->nrows; i++)
+    abAppend(&rec, op->rows[i].text, op->rows[i].len);
+  undoRecordPut(b, UNDO_RECORD_OP, rec.b, rec.len);
+  abFree(&rec);
+}
+
+// Drops the log and the mapping of the undo file.
+void undoReset() {
+  for (int i = 0; i < nops; i++) freeRowTexts(ops[i].rows, ops[i].nrows);
+  nops = undo_at = journaled = journal_records = 0;
+  arenalen = 0;
+  group_open = 0;
+  if (journal_map) munmap(journal_map, journal_maplen);
+  journal_map = NULL;
+  free(journal_path);
+  journal_path = NULL;
+}
+
+// Drops a log that turned out not to fit the text, along with its undo
+// file, which the next save rewrites.
+void undoDiscard() {
+  replaying = 0;
+  undoReset();
+  if (E.filename) journal_path = editorSideFilePath(E.filename, "undo");
+  journal_records = -1;
+  editorSetStatusMessage("Undo history does not fit the text, dropped it");
+}
+
+// Reads one op record at p into the log. Returns 0 if it is malformed.
+int undoOpGet(char *p, uint32_t size) {
+  struct undoOpRecord r;
+  if (size < sizeof(r)) return 0;
+  memcpy(&r, p, sizeof(r));
+  if (r.index < 0 || r.index > nops || r.kind < OP_INSERT ||
+      r.kind > OP_ROWS || r.len < 0 || r.nrows < 0 ||
+      (uint64_t)sizeof(r) + r.nrows * 8ULL + r.len > size)
+    return 0;
+  // Rows are checked against the buffer once the whole log is in.
+  if (r.y < 0 || r.x < COL_OFFSET || r.ey < r.y || r.ex < COL_OFFSET)
+    return 0;
+  undo_at = r.index;
+  struct undoOp *op = addUndoOp(r.kind, r.y, r.x);
+  op->reversed = r.reversed;
+  op->group = r.group;
+  op->ey = r.ey;
+  op->ex = r.ex;
+  op->len = r.len;
+  op->mapped = 1;
+  char *pairs = p + sizeof(r);
+  op->off = pairs + r.nrows * 8 - journal_map;
+  if (r.nrows == 0) return 1;
+
+  // Row texts are swapped into rows, so they are copied out of the map.
+  op->rows = malloc(sizeof(struct rowText) * r.nrows);
+  op->nrows = r.nrows;
+  char *text = pairs + r.nrows * 8 + r.len;
+  for (int i = 0; i < r.nrows; i++) {
+    int32_t pair[2];
+    memcpy(pair, pairs + i * 8, sizeof(pair));
+    if (pair[0] < 0 || pair[1] < 0 || text + pair[1] > p + size) {
+      op->nrows = i;
+      return 0;
+    }
+    op->rows[i].at = pair[0];
+    op->rows[i].len = pair[1];
+    op->rows[i].text = malloc(pair[1] + 1);
+    memcpy(op->rows[i].text, text, pair[1]);
+    op->rows[i].text[pair[1]] = '\0';
+    text += pair[1];
+  }
+  return 1;
+}
+
+// Returns whether op can be applied, or reverted if undo is set, to a
+// buffer of *rows rows, and sets *rows to the count after.
+int undoOpFitsRows(struct undoOp *op, int undo, int *rows) {
+  int insert = (op->kind == OP_INSERT || op->kind == OP_INSERT_ROW) != undo;
+  int lines = 0;
+  switch (op->kind) {
+    case OP_INSERT:
+    case OP_DELETE:
+      for (int i = 0; i < op->len; i++)
+        lines += journal_map[op->off + i] == '\n';
+      if (op->y + (insert ? 0 : lines) >= *rows) return 0;
+      *rows += insert ? lines : -lines;
+      return 1;
+    case OP_INSERT_ROW:
+    case OP_DELETE_ROW:
+      if (op->y > (insert ? *rows : *rows - 1)) return 0;
+      *rows += insert ? 1 : -1;
+      return 1;
+    case OP_ROWS:
+      for (int i = 0; i < op->nrows; i++)
+        if (op->rows[i].at >= *rows) return 0;
+      return 1;
+  }
+  return 0;
+}
+
+// Returns whether every op of the log read back edits rows that exist when
+// it is undone or redone, starting from the buffer as loaded.
+int undoOpsFitRows() {
+  int rows = E.numrows;
+  for (int i = undo_at - 1; i >= 0; i--)
+    if (!undoOpFitsRows(&ops[i], 1, &rows)) return 0;
+  rows = E.numrows;
+  for (int i = undo_at; i < nops; i++)
+    if (!undoOpFitsRows(&ops[i], 0, &rows)) return 0;
+  return 1;
+}
+
+// Reads the undo file of filename. hashed tells whether size and hash are
+// those of the file already, or the file has to be hashed to check the
+// undo file against it.
+void undoLoad(const char *filename, int hashed, uint64_t size,
+              uint64_t hash) {
+  undoReset();
+  journal_path = editorSideFilePath(filename, "undo");
+  journal_records = -1;
+  int fd = open(journal_path, O_RDONLY);
+  if (fd == -1) return;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < 8) {
+    close(fd);
+    return;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return;
+  journal_map = map;
+  journal_maplen = st.st_size;
+  if (memcmp(map, UNDO_MAGIC, 8)) goto stale;
+  journal_records = 0;
+
+  // Records after the last save are from a save that did not finish.
+  size_t end = 0;
+  struct undoSaveRecord save;
+  struct undoRecord rec;
+  for (size_t p = 8; p + sizeof(rec) <= journal_maplen;) {
+    memcpy(&rec, map + p, sizeof(rec));
+    if (rec.size > journal_maplen - p - sizeof(rec)) break;
+    p += sizeof(rec);
+    if (rec.type == UNDO_RECORD_SAVE && rec.size >= sizeof(save)) {
+      memcpy(&save, map + p, sizeof(save));
+      end = p + rec.size;
+    }
+    p += rec.size;
+  }
+  if (!end) goto stale;
+  if (!hashed) {
+    // A file of another size cannot match, and is not worth hashing.
+    if (stat(filename, &st) == -1 || (uint64_t)st.st_size != save.size ||
+        !editorHashFile(filename, &size, &hash))
+      goto stale;
+  }
+  if (size != save.size || hash != save.hash) goto stale;
+
+  for (size_t p = 8; p < end;) {
+    memcpy(&rec, map + p, sizeof(rec));
+    p += sizeof(rec);
+    if (rec.type == UNDO_RECORD_OP) {
+      if (!undoOpGet(map + p, rec.size)) goto stale;
+      journal_records++;
+    }
+    p += rec.size;
+  }
+  if (save.nops != nops || save.undo_at < 0 || save.undo_at > nops)
+    goto stale;
+  undo_at = save.undo_at;
+  if (!undoOpsFitRows()) goto stale;
+  group = save.group;
+  group_open = 0;
+  journaled = nops;
+  return;
+
+stale:
+  // The undo file is rewritten by the next save.
+  undoReset();
+  journal_path = editorSideFilePath(filename, "undo");
+  journal_records = -1;
+}
+
+void editorLoadUndoFile(const char *filename) {
+  undoLoad(filename, 0, 0, 0);
+}
+
+// Like editorLoadUndoFile, for a caller that hashed the file as it read it.
+void editorLoadUndoFileHashed(const char *filename, uint64_t size,
+                              uint64_t hash) {
+  undoLoad(filename, 1, size, hash);
+}
+
+// Starts a save snapshot of the buffer. Returns the log position that
+// editorSaveUndoFile records for it.
+int editorUndoMark() {
+  closeUndoGroup();
+  marked = nops;
+  return undo_at;
+}
+
+// Records that the file was saved with the content the log had at
+// position at. If ops before it changed since, the state is gone and the
+// undo file is left to go stale.
+void editorSaveUndoFile(const char *filename, uint64_t size, uint64_t hash,
+                        int at) {
+  if (at > marked) {
+    journal_records = -1;
+    return;
+  }
+  char *path = editorSideFilePath(filename, "undo");
+  int rewrite = !journal_path || strcmp(path, journal_path) ||
+                journal_records < 0 || journal_records > 2 * nops + 64;
+  free(journal_path);
+  journal_path = path;
+
+  struct abuf b = ABUF_INIT;
+  if (rewrite) {
+    abAppend(&b, UNDO_MAGIC, 8);
+    journaled = 0;
+    journal_records = 0;
+  }
+  for (int i = journaled; i < nops; i++) undoOpPut(&b, i);
+  journal_records += nops - journaled;
+  struct undoSaveRecord save = {hash, size, nops, at, group, 0};
+  undoRecordPut(&b, UNDO_RECORD_SAVE, &save, sizeof(save));
+
+  int fd;
+  if (rewrite) {
+    // Replaced rather than truncated, since its old content may be mapped.
+    char *tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1 && (write(fd, b.b, b.len) != b.len || rename(tmp, path))) {
+      close(fd);
+      unlink(tmp);
+      fd = -1;
+    }
+    free(tmp);
+  } else {
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd != -1 && write(fd, b.b, b.len) != b.len) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd != -1) {
+    close(fd);
+    journaled = nops;
+  } else {
+    journal_records = -1;
+  }
+  abFree(&b);
 }
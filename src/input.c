@@ -1,8 +1,6 @@
 #include "input.h"
 
 #include <ctype.h>
-#include <errno.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,136 +8,198 @@
 
 #include "definitions.h"
 #include "find.h"
+#include "follow.h"
 #include "highlight.h"
 #include "history.h"
+#include "load.h"
 #include "output.h"
+#include "rowBuffer.h"
 #include "rowOperations.h"
+#include "save.h"
+#include "substitute.h"
+#include "swap.h"
 #include "terminal.h"
 
 /*** editor operations ***/
+// Refuses an edit while the buffer cannot be changed.
+int editorReadOnly() {
+  if (editorLoading())
+    editorSetStatusMessage("Still loading, the file can't be changed yet");
+  else if (editorFollowing())
+    editorSetStatusMessage("Following the file, :nofollow to edit");
+  else
+    return 0;
+  return 1;
+}
+
 void editorInsertChar(int c) {
   if (E.cy == E.numrows) {
+    addUndoInsertRow(E.numrows);
     editorInsertRow(E.numrows, "", 0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx - COL_OFFSET, c);
+  char ch = c;
+  addUndoInsert(E.cy, E.cx, &ch, 1);
+  editorRowInsertChar(editorRow(E.cy), E.cx - COL_OFFSET, c);
   E.cx++;
 }
 
 void editorInsertNewline() {
+  if (E.cy == E.numrows)
+    addUndoInsertRow(E.cy);
+  else
+    addUndoInsert(E.cy, E.cx, "\n", 1);
   if (E.cx == COL_OFFSET) {
     editorInsertRow(E.cy, "", 0);
   } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx - COL_OFFSET],
+    erow *row = editorRow(E.cy);
+    editorInsertRow(E.cy + 1, &editorRowChars(row)[E.cx - COL_OFFSET],
                     row->size - E.cx + COL_OFFSET);
-    row = &E.row[E.cy];
-    row->size = E.cx - COL_OFFSET;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    editorRowTruncate(editorRow(E.cy), E.cx - COL_OFFSET);
   }
   E.cy++;
   E.cx = COL_OFFSET;
 }
 
+// Inserts text that may span several lines at the cursor. The row is split
+// once and the cursor ends up after the inserted text.
+void editorInsertText(char *s, int len) {
+  if (E.cy == E.numrows) {
+    addUndoInsertRow(E.numrows);
+    editorInsertRow(E.numrows, "", 0);
+  }
+  addUndoInsert(E.cy, E.cx, s, len);
+  int at = E.cx - COL_OFFSET;
+  char *nl = memchr(s, '\n', len);
+  if (nl == NULL) {
+    editorRowInsertString(editorRow(E.cy), at, s, len);
+    E.cx += len;
+    return;
+  }
+  erow *row = editorRow(E.cy);
+  editorInsertRow(E.cy + 1, &editorRowChars(row)[at], row->size - at);
+  editorRowTruncate(editorRow(E.cy), at);
+  editorRowAppendString(editorRow(E.cy), s, nl - s);
+
+  char *end = s + len;
+  char *line = nl + 1;
+  while ((nl = memchr(line, '\n', end - line)) != NULL) {
+    E.cy++;
+    editorInsertRow(E.cy, line, nl - line);
+    line = nl + 1;
+  }
+  E.cy++;
+  editorRowInsertString(editorRow(E.cy), 0, line, end - line);
+  E.cx = (end - line) + COL_OFFSET;
+}
+
+// Removes text previously inserted at row y, column x by editorInsertText.
+void editorDeleteText(int y, int x, char *s, int len) {
+  int lines = 0;
+  int last = len;  // Length of the last line of s
+  for (int i = 0; i < len; i++) {
+    if (s[i] == '\n') {
+      lines++;
+      last = len - i - 1;
+    }
+  }
+  int at = x - COL_OFFSET;
+  if (lines == 0) {
+    editorRowDelChars(editorRow(y), at, len);
+  } else {
+    erow *end = editorRow(y + lines);
+    editorRowTruncate(editorRow(y), at);
+    editorRowAppendString(editorRow(y), &editorRowChars(end)[last],
+                          end->size - last);
+    for (int i = 0; i < lines; i++) editorDelRow(y + 1);
+  }
+  E.cy = y;
+  E.cx = x;
+}
+
 void editorDelChar() {
   if (E.cy == E.numrows) return;
   if (E.cx == COL_OFFSET && E.cy == 0) return;
-  erow *row = &E.row[E.cy];
+  erow *row = editorRow(E.cy);
   if (E.cx > COL_OFFSET) {
+    char ch = editorRowCharAt(row, E.cx - 1 - COL_OFFSET);
+    addUndoDelete(E.cy, E.cx - 1, &ch, 1);
     editorRowDelChar(row, E.cx - 1 - COL_OFFSET);
     E.cx--;
   } else {
-    E.cx = E.row[E.cy - 1].size + COL_OFFSET;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    erow *prev = editorRow(E.cy - 1);
+    addUndoDelete(E.cy - 1, prev->size + COL_OFFSET, "\n", 1);
+    E.cx = prev->size + COL_OFFSET;
+    editorRowAppendString(prev, editorRowChars(row), row->size);
     editorDelRow(E.cy);
     E.cy--;
   }
 }
 
 /*** file i/o ***/
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
-  }
-  return buf;
-}
-
 void editorOpen(char *filename) {
   free(E.filename);
   E.filename = strdup(filename);
 
   editorSelectSyntaxHighlight();
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
-  }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
-}
-
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-    editorSelectSyntaxHighlight();
-  }
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+  // Regular files are loaded in the background, see load.c.
+  if (editorLoadStart(filename) == -1) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    E.filesize = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+      E.filesize += linelen;
+      while (linelen > 0 &&
+             (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        linelen--;
+      editorInsertRow(E.numrows, line, linelen);
     }
-    close(fd);
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    editorLoadUndoFile(filename);
+    editorSwapOpen(filename);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
 /*** command mode ***/
 void commandCallback(char *command, int key) {
   if (key == '\r') {
     if (strcmp(command, "wq") == 0 || strcmp(command, "x") == 0) {
+      if (editorReadOnly()) return;
+      editorSaveWait();
       editorSave();
+      // A failed save keeps the swap file for recovery.
+      if (editorSaveWait() && !E.dirty) editorSwapClose();
       cleanExit();
     } else if (strcmp(command, "w") == 0) {
+      if (editorReadOnly()) return;
       editorSave();
     } else if (strcmp(command, "q") == 0) {
+      editorSaveWait();
       if (E.dirty) {
         editorSetStatusMessage(
             "Dirty file, try :q! if you want to discard changes.");
         return;
       }
+      editorSwapClose();
       cleanExit();
     } else if (strcmp(command, "q!") == 0 || strcmp(command, "q1") == 0) {
+      editorSaveWait();
+      editorSwapClose();
       cleanExit();
+    } else if (strcmp(command, "follow") == 0) {
+      editorFollowStart();
+    } else if (strcmp(command, "nofollow") == 0) {
+      editorFollowStop();
+    } else if (strcmp(command, "noh") == 0 ||
+               strcmp(command, "nohlsearch") == 0) {
+      editorFindClearHighlight();
+    } else if (editorSubstitute(command)) {
+      return;
     } else {
       editorSetStatusMessage("no match");
     }
@@ -162,7 +222,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   buf[0] = '\0';
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    if (!editorInputPending()) editorRefreshScreen();
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0) buf[--buflen] = '\0';
@@ -177,6 +237,19 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE_KEY) {
+      int len;
+      char *text = editorTakePaste(&len);
+      for (int i = 0; i < len; i++) {
+        if (iscntrl(text[i])) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = text[i];
+      }
+      buf[buflen] = '\0';
+      free(text);
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
@@ -190,7 +263,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRow(E.cy);
   switch (key) {
     case 'h':
     case ARROW_LEFT:
@@ -198,7 +271,7 @@ void editorMoveCursor(int key) {
         E.cx--;
       } else if (E.cy > 0) {
         E.cy--;
-        E.cx = E.row[E.cy].size + COL_OFFSET;
+        E.cx = editorRow(E.cy)->size + COL_OFFSET;
       }
       break;
     case 'l':
@@ -223,7 +296,7 @@ void editorMoveCursor(int key) {
       }
       break;
   }
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = editorRow(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen + COL_OFFSET) {
     E.cx = rowlen + COL_OFFSET;
@@ -231,7 +304,7 @@ void editorMoveCursor(int key) {
 }
 
 void editorMoveCursorWord() {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRow(E.cy);
   if (row == NULL) return;
   int position = E.cx - COL_OFFSET;
   int quantifier = E.command_quantifier ? E.command_quantifier : 1;
@@ -246,7 +319,7 @@ void editorMoveCursorWord() {
       editorMoveCursorWord();
       return;
     };
-    c = row->chars[position];
+    c = editorRowChars(row)[position];
     if (c < 'A' || c > 'z') {
       quantifier--;
     }
@@ -260,7 +333,7 @@ void editorMoveCursorWord() {
 }
 
 void editorMoveCursorBack() {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRow(E.cy);
   if (row == NULL) return;
   int position = E.cx - COL_OFFSET;
   int quantifier = E.command_quantifier ? E.command_quantifier : 1;
@@ -269,14 +342,14 @@ void editorMoveCursorBack() {
     position--;
     if (position < 0 && E.cy > 0) {
       E.cy--;
-      E.cx = COL_OFFSET + E.row[E.cy].size;
+      E.cx = COL_OFFSET + editorRow(E.cy)->size;
       quantifier--;
       if (quantifier < 1) return;
       E.command_quantifier = quantifier;
       editorMoveCursorBack();
       return;
     };
-    c = row->chars[position - 1];
+    c = editorRowChars(row)[position - 1];
     if (c < 'A' || c > 'z') {
       quantifier--;
     }
@@ -290,7 +363,7 @@ void editorMoveCursorBack() {
 
 void editorProcessSecondKey(char prevChar) {
   E.prevCommand = prevChar;
-  editorRefreshScreen();
+  if (!editorInputPending()) editorRefreshScreen();
 
   char c = editorReadKey();
 
@@ -301,7 +374,9 @@ void editorProcessSecondKey(char prevChar) {
       E.prevCommand = ' ';
       break;
     case 'd':
-      if (prevChar == 'd') {
+      if (prevChar == 'd' && E.cy < E.numrows && !editorReadOnly()) {
+        erow *row = editorRow(E.cy);
+        addUndoDeleteRow(E.cy, editorRowChars(row), row->size);
         editorDelRow(E.cy);
       }
       E.prevCommand = ' ';
@@ -330,6 +405,9 @@ void editorProcessKeypress() {
   int c = editorReadKey();
 
   if (E.mode == NORMAL) {
+    // Each normal mode command is its own undo step, and so is everything
+    // typed in one visit to insert mode.
+    closeUndoGroup();
     switch (c) {
       case '\x1b':
         E.command_quantifier = 0;
@@ -340,6 +418,7 @@ void editorProcessKeypress() {
         editorCommandMode();
         break;
       case 'i':
+        if (editorReadOnly()) break;
         E.mode = INSERT;
         editorSetStatusMessage("Insert mode");
         break;
@@ -353,7 +432,6 @@ void editorProcessKeypress() {
           E.command_quantifier--;
         }
         editorSetStatusMessage("");
-        editorRefreshScreen();
         break;
       case BACKSPACE:
         editorMoveCursor(ARROW_LEFT);
@@ -365,23 +443,27 @@ void editorProcessKeypress() {
         editorMoveCursorBack();
         break;
       case '$':
-        E.cx = E.row->size + COL_OFFSET;
+        if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size + COL_OFFSET;
         break;
       case 'o':
-        E.cx = E.row[E.cy].size + COL_OFFSET;
+        if (editorReadOnly()) break;
+        if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size + COL_OFFSET;
         editorInsertNewline();
         E.mode = INSERT;
         break;
       case 'x':
+        if (editorReadOnly()) break;
         editorMoveCursor(ARROW_RIGHT);
         editorDelChar();
         break;
       case 'a':
+        if (editorReadOnly()) break;
         editorMoveCursor(ARROW_RIGHT);
         E.mode = INSERT;
         break;
       case 'A':
-        E.cx = E.row[E.cy].size + COL_OFFSET;
+        if (editorReadOnly()) break;
+        if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size + COL_OFFSET;
         E.mode = INSERT;
         break;
       case 'd':
@@ -398,11 +480,11 @@ void editorProcessKeypress() {
         editorFind();
         break;
       case 'u':
-        editorSetStatusMessage("Undo: %c", undo_history[E.undo_level.level].c);
+        if (editorReadOnly()) break;
         doUndo();
         break;
       case CTRL_KEY('r'):
-        editorSetStatusMessage("Redo");
+        if (editorReadOnly()) break;
         doRedo();
         break;
       default:
@@ -435,7 +517,7 @@ void editorProcessKeypress() {
         E.cx = COL_OFFSET;
         break;
       case END_KEY:
-        if (E.cy < E.numrows) E.cx = E.row[E.cy].size + COL_OFFSET;
+        if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size + COL_OFFSET;
         break;
 
       case BACKSPACE:
@@ -462,10 +544,15 @@ void editorProcessKeypress() {
       case ARROW_RIGHT:
         editorMoveCursor(c);
         break;
+      case PASTE_KEY: {
+        int len;
+        char *text = editorTakePaste(&len);
+        editorInsertText(text, len);
+        free(text);
+      } break;
       case CTRL_KEY('l'):
       default:
         editorInsertChar(c);
-        addUndo(c);
         break;
     }
   }
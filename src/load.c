@@ -0,0 +1,204 @@
+#include "load.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "event.h"
+#include "history.h"
+#include "matchIndex.h"
+#include "rowOperations.h"
+#include "swap.h"
+#include "terminal.h"
+
+/*** progressive load ***/
+// A regular file is mapped and a reader thread finds where its lines start.
+// It publishes them in batches, and the main thread appends them as mapped
+// rows, so the screen draws as soon as the first screenful is found and the
+// rest streams in behind it. The first batch holds E.screenrows lines, the
+// later ones LOAD_BATCH_ROWS lines or LOAD_BATCH_BYTES of the file.
+//
+// The loaded part can be moved around in and searched, but not changed,
+// until the whole file is in. The undo and swap files are opened then. The
+// reader hashes the file on its way through, so checking the undo file
+// against it does not read the file again on the main thread.
+#define LOAD_CHUNK_ROWS 4096
+#define LOAD_BATCH_ROWS 65536
+#define LOAD_BATCH_BYTES (16 << 20)
+
+struct loadRow {
+  char *chars;
+  int size;
+};
+
+static struct {
+  pthread_t thread;
+  int threaded;
+  int running;
+  int notify[2];
+  char *map;
+  size_t len;
+  int first;  // Lines in the batch that draws the first screen
+  pthread_mutex_t lock;
+  struct loadRow *rows;  // Published lines, not yet appended
+  int nrows;
+  int cap;
+  int signaled;  // A batch is waiting for the main thread
+  int done;
+  atomic_size_t scanned;
+  uint64_t hash;  // Content hash of the file, once done
+} ld = {.notify = {-1, -1}, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Hands a chunk of lines to the main thread. Wakes it once want lines or
+// LOAD_BATCH_BYTES of the file since the last wake are waiting, and
+// returns whether it did.
+int loadPublish(struct loadRow *chunk, int n, int want, size_t unread,
+                int done) {
+  pthread_mutex_lock(&ld.lock);
+  if (ld.nrows + n > ld.cap) {
+    ld.cap = ld.nrows + n > ld.cap * 2 ? ld.nrows + n : ld.cap * 2;
+    ld.rows = realloc(ld.rows, sizeof(struct loadRow) * ld.cap);
+  }
+  memcpy(&ld.rows[ld.nrows], chunk, sizeof(struct loadRow) * n);
+  ld.nrows += n;
+  ld.done = done;
+  int wake = !ld.signaled && (ld.nrows >= want ||
+                              unread >= LOAD_BATCH_BYTES || done);
+  if (wake) {
+    ld.signaled = 1;
+    write(ld.notify[1], "", 1);
+  }
+  pthread_mutex_unlock(&ld.lock);
+  return wake;
+}
+
+void *loadReaderRun(void *arg) {
+  (void)arg;
+  struct loadRow chunk[LOAD_CHUNK_ROWS];
+  int n = 0;
+  int limit = ld.first < LOAD_CHUNK_ROWS ? ld.first : LOAD_CHUNK_ROWS;
+  int want = ld.first;
+  char *woke = ld.map;
+  char *flushed = ld.map;
+  char *p = ld.map;
+  char *end = ld.map + ld.len;
+  struct contentHash hash;
+  editorHashInit(&hash, ld.len);
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *next = nl ? nl + 1 : end;
+    if (nl == NULL) nl = end;
+    while (nl > p && (nl[-1] == '\n' || nl[-1] == '\r')) nl--;
+    chunk[n++] = (struct loadRow){p, nl - p};
+    p = next;
+    if (n == limit || p - flushed >= LOAD_BATCH_BYTES) {
+      editorHashUpdate(&hash, flushed, p - flushed);
+      atomic_store_explicit(&ld.scanned, p - ld.map, memory_order_relaxed);
+      if (loadPublish(chunk, n, want, p - woke, 0)) {
+        want = LOAD_BATCH_ROWS;
+        woke = p;
+      }
+      n = 0;
+      limit = LOAD_CHUNK_ROWS;
+      flushed = p;
+    }
+  }
+  editorHashUpdate(&hash, flushed, p - flushed);
+  ld.hash = editorHashFinal(&hash);
+  atomic_store_explicit(&ld.scanned, ld.len, memory_order_relaxed);
+  loadPublish(chunk, n, want, p - woke, 1);
+  return NULL;
+}
+
+void loadFinish() {
+  if (ld.threaded) pthread_join(ld.thread, NULL);
+  ld.running = 0;
+  free(ld.rows);
+  ld.rows = NULL;
+  ld.nrows = ld.cap = 0;
+  madvise(ld.map, ld.len, MADV_NORMAL);
+  E.dirty = 0;
+  editorLoadUndoFileHashed(E.filename, ld.len, ld.hash);
+  editorSwapOpen(E.filename);
+}
+
+// Appends the published lines on the main thread.
+void loadCollect(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  if (!ld.running) return;
+  // Search workers read the rows in place, and appending may move them.
+  editorMatchIndexInvalidate(E.numrows);
+  pthread_mutex_lock(&ld.lock);
+  for (int i = 0; i < ld.nrows; i++)
+    editorAppendMappedRow(ld.rows[i].chars, ld.rows[i].size);
+  ld.nrows = 0;
+  ld.signaled = 0;
+  int done = ld.done;
+  pthread_mutex_unlock(&ld.lock);
+  editorMatchIndexUpdate();
+  if (done) loadFinish();
+}
+
+// Maps filename and starts loading it. Returns -1 if it cannot be mapped,
+// and the caller has to read it instead.
+int editorLoadStart(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  E.map = ld.map = map;
+  E.maplen = ld.len = st.st_size;
+  E.filesize = st.st_size;
+
+  if (ld.notify[0] == -1) {
+    if (pipe(ld.notify) == -1) die("pipe");
+    fcntl(ld.notify[0], F_SETFL, O_NONBLOCK);
+    editorWatchFd(ld.notify[0], loadCollect);
+  }
+  ld.first = E.screenrows > 0 ? E.screenrows : 1;
+  ld.signaled = ld.done = 0;
+  atomic_store(&ld.scanned, 0);
+  ld.running = 1;
+  ld.threaded = !pthread_create(&ld.thread, NULL, loadReaderRun, NULL);
+  // Without a thread the whole file is indexed right here.
+  if (!ld.threaded) {
+    loadReaderRun(NULL);
+    loadCollect(ld.notify[0]);
+  }
+  return 0;
+}
+
+int editorLoading() { return ld.running; }
+
+// Blocks until the whole file is in, for callers without an event loop.
+void editorLoadWait() {
+  while (ld.running) {
+    struct pollfd pfd = {ld.notify[0], POLLIN, 0};
+    poll(&pfd, 1, -1);
+    loadCollect(ld.notify[0]);
+  }
+}
+
+// Describes the load for the status bar, e.g. "loading 42%".
+int editorLoadStatus(char *buf, int size) {
+  if (!ld.running) return 0;
+  size_t scanned = atomic_load_explicit(&ld.scanned, memory_order_relaxed);
+  return snprintf(buf, size, "loading %d%%", (int)(scanned * 100 / ld.len));
+}
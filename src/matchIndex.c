@@ -0,0 +1,310 @@
+#include "matchIndex.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "event.h"
+#include "pattern.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+#include "search.h"
+#include "terminal.h"
+
+/*** match index ***/
+// Every search is also run over the whole file by worker threads that each
+// take a slice of the rows. A worker finds the matches of its slice in
+// order, so the slices joined in order form a sorted index of every match.
+//
+// Workers only read rows. Reading a row with an open gap means closing it,
+// so the one open gap is closed before they start. The search prompt does
+// not edit the buffer, but a load or :follow may add or replace rows while
+// it is open. They call editorMatchIndexInvalidate before rows change,
+// which cancels the workers and drops the matches of the rows that change,
+// and editorMatchIndexUpdate after, which indexes the rows from there on.
+#define MAX_SEARCH_WORKERS 8
+#define MIN_ROWS_PER_WORKER 4096
+#define MATCH_PIECE_BYTES (1 << 20)  // Scanned between checks for a cancel
+
+struct matchList {
+  struct match *m;
+  int len;
+  int cap;
+};
+
+struct searchWorker {
+  pthread_t thread;
+  int threaded;
+  int from;
+  int to;
+  struct pattern *pattern;
+  struct matchList matches;
+};
+
+struct matchIndex {
+  char *query;
+  int len;
+  int regex;
+  int indexed;  // Rows before this one have all their matches listed
+  struct searchWorker workers[MAX_SEARCH_WORKERS];
+  int nworkers;
+  int running;
+  int finished;
+  atomic_int cancel;
+  int notify[2];
+  struct matchList matches;
+  int ready;
+  int cur_row;
+  int cur_col;
+};
+
+static struct matchIndex mi = {.notify = {-1, -1}};
+
+void matchListAdd(struct matchList *l, int row, int col, int len) {
+  if (l->len == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->m = realloc(l->m, sizeof(struct match) * l->cap);
+  }
+  l->m[l->len++] = (struct match){row, col, len};
+}
+
+// Appends the regex matches of one row; used as a patternMatchAll report.
+struct rowMatches {
+  struct matchList *list;
+  int row;
+};
+
+void rowMatchesAdd(void *arg, int start, int end) {
+  struct rowMatches *rm = arg;
+  matchListAdd(rm->list, rm->row, start, end - start);
+}
+
+int matchIndexCancelled() {
+  return atomic_load_explicit(&mi.cancel, memory_order_relaxed);
+}
+
+void *searchWorkerRun(void *arg) {
+  struct searchWorker *w = arg;
+  int at = w->from;
+  while (at < w->to && !matchIndexCancelled()) {
+    erow *row = editorRow(at);
+    if (w->pattern) {
+      struct rowMatches rm = {&w->matches, at};
+      patternMatchAll(w->pattern, row->chars, row->size, rowMatchesAdd, &rm);
+      at++;
+      continue;
+    }
+    // Literal matches cannot span rows, so a whole span of mapped rows is
+    // scanned at once and each match mapped back to its row.
+    int end = editorSpanEnd(at, w->to);
+    erow *last = editorRow(end - 1);
+    const char *p = row->chars;
+    const char *stop = last->chars + last->size;
+    const char *m;
+    int r = at;
+    while (p < stop) {
+      // A long row is searched a piece at a time, so a cancel is seen soon.
+      const char *limit = stop;
+      if (stop - p > MATCH_PIECE_BYTES + mi.len)
+        limit = p + MATCH_PIECE_BYTES + mi.len - 1;
+      m = searchMemmem(p, limit - p, mi.query, mi.len);
+      if (!m) {
+        if (limit == stop || matchIndexCancelled()) break;
+        p = limit - mi.len + 1;
+        continue;
+      }
+      r = editorSpanRow(r, end, m);
+      matchListAdd(&w->matches, r, m - editorRow(r)->chars, mi.len);
+      p = m + 1;
+    }
+    at = end;
+  }
+  write(mi.notify[1], "", 1);
+  return NULL;
+}
+
+void matchIndexJoin() {
+  for (int i = 0; i < mi.nworkers; i++)
+    if (mi.workers[i].threaded) pthread_join(mi.workers[i].thread, NULL);
+  char buf[MAX_SEARCH_WORKERS];
+  while (read(mi.notify[0], buf, sizeof(buf)) > 0)
+    ;
+  mi.running = 0;
+}
+
+void matchIndexFreeWorkers() {
+  for (int i = 0; i < mi.nworkers; i++) {
+    struct searchWorker *w = &mi.workers[i];
+    patternFree(w->pattern);
+    free(w->matches.m);
+    memset(w, 0, sizeof(*w));
+  }
+  mi.nworkers = 0;
+}
+
+// Returns the number of matches before (row, col).
+int matchIndexLowerBound(int row, int col) {
+  int lo = 0, hi = mi.matches.len;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    struct match *m = &mi.matches.m[mid];
+    if (m->row < row || (m->row == row && m->col < col))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Runs on the main thread once every worker has reported back.
+void matchIndexCollect(int fd) {
+  char buf[MAX_SEARCH_WORKERS];
+  int n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) mi.finished += n;
+  if (!mi.running || mi.finished < mi.nworkers) return;
+  matchIndexJoin();
+
+  int total = 0;
+  for (int i = 0; i < mi.nworkers; i++) total += mi.workers[i].matches.len;
+  struct matchList *all = &mi.matches;
+  if (all->len + total > all->cap) {
+    all->cap = all->len + total;
+    all->m = realloc(all->m, sizeof(struct match) * all->cap);
+  }
+  for (int i = 0; i < mi.nworkers; i++) {
+    struct searchWorker *w = &mi.workers[i];
+    memcpy(&all->m[all->len], w->matches.m,
+           sizeof(struct match) * w->matches.len);
+    all->len += w->matches.len;
+  }
+  mi.indexed = mi.workers[mi.nworkers - 1].to;
+  matchIndexFreeWorkers();
+  editorMatchIndexUpdate();
+}
+
+// Cancels the workers and drops what they found.
+void matchIndexCancel() {
+  if (mi.running) {
+    atomic_store(&mi.cancel, 1);
+    matchIndexJoin();
+  }
+  matchIndexFreeWorkers();
+}
+
+// Cancels a running search and drops the index.
+void editorMatchIndexStop() {
+  matchIndexCancel();
+  free(mi.query);
+  mi.query = NULL;
+  mi.matches.len = 0;
+  mi.indexed = 0;
+  mi.ready = 0;
+}
+
+// Rows from `from` on are about to change, or rows are about to be added
+// if it is E.numrows. Their matches are dropped until editorMatchIndexUpdate.
+void editorMatchIndexInvalidate(int from) {
+  if (!mi.query) return;
+  matchIndexCancel();
+  mi.ready = 0;
+  if (from >= mi.indexed) return;
+  mi.matches.len = matchIndexLowerBound(from, 0);
+  mi.indexed = from;
+}
+
+// Indexes the rows that are not indexed yet. The index is ready once they
+// all are.
+void editorMatchIndexUpdate() {
+  if (!mi.query || mi.running) return;
+  if (mi.indexed >= E.numrows) {
+    mi.ready = 1;
+    return;
+  }
+  int from = mi.indexed;
+  int rows = E.numrows - from;
+  int n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > MAX_SEARCH_WORKERS) n = MAX_SEARCH_WORKERS;
+  if (n > rows / MIN_ROWS_PER_WORKER) n = rows / MIN_ROWS_PER_WORKER;
+  if (n < 1) n = 1;
+  for (int i = 0; i < n; i++) {
+    struct searchWorker *w = &mi.workers[i];
+    if (mi.regex) {
+      w->pattern = patternCompile(mi.query);
+      patternSetCancel(w->pattern, &mi.cancel);
+    }
+    w->from = from + (long)rows * i / n;
+    w->to = from + (long)rows * (i + 1) / n;
+    mi.nworkers++;
+  }
+
+  editorCloseGap();
+  mi.finished = 0;
+  atomic_store(&mi.cancel, 0);
+  mi.running = 1;
+  for (int i = 0; i < n; i++) {
+    struct searchWorker *w = &mi.workers[i];
+    w->threaded = !pthread_create(&w->thread, NULL, searchWorkerRun, w);
+    // Without a thread the slice is searched right here.
+    if (!w->threaded) searchWorkerRun(w);
+  }
+}
+
+void editorMatchIndexStart(const char *query, int regex) {
+  editorMatchIndexStop();
+  if (!query[0]) return;
+  // An invalid pattern has no matches to index.
+  if (regex) {
+    struct pattern *p = patternCompile(query);
+    if (!p) return;
+    patternFree(p);
+  }
+  if (mi.notify[0] == -1) {
+    if (pipe(mi.notify) == -1) die("pipe");
+    fcntl(mi.notify[0], F_SETFL, O_NONBLOCK);
+    editorWatchFd(mi.notify[0], matchIndexCollect);
+  }
+  mi.query = strdup(query);
+  mi.len = strlen(query);
+  mi.regex = regex;
+  mi.cur_row = mi.cur_col = 0;
+  editorMatchIndexUpdate();
+}
+
+int editorMatchIndexReady() { return mi.ready; }
+
+// Finds the match after (direction 1), before (-1) or at or after (0) the
+// given position, wrapping around the file. Returns 0 if there is none.
+int editorMatchIndexSeek(int row, int col, int direction, struct match *m) {
+  int n = mi.matches.len;
+  if (!mi.ready || n == 0) return 0;
+  int k;
+  if (direction < 0) {
+    k = matchIndexLowerBound(row, col) - 1;
+    if (k < 0) k = n - 1;
+  } else {
+    k = matchIndexLowerBound(row, direction > 0 ? col + 1 : col);
+    if (k == n) k = 0;
+  }
+  *m = mi.matches.m[k];
+  return 1;
+}
+
+void editorMatchIndexSetCurrent(int row, int col) {
+  mi.cur_row = row;
+  mi.cur_col = col;
+}
+
+// Describes the search for the status bar, e.g. "match 3 of 120".
+int editorMatchIndexStatus(char *buf, int size) {
+  if (mi.running) return snprintf(buf, size, "searching");
+  if (!mi.ready) return 0;
+  if (mi.matches.len == 0) return snprintf(buf, size, "no matches");
+  int k = matchIndexLowerBound(mi.cur_row, mi.cur_col) + 1;
+  if (k > mi.matches.len) k = mi.matches.len;
+  return snprintf(buf, size, "match %d of %d", k, mi.matches.len);
+}
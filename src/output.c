@@ -1,3 +1,5 @@
+#include "output.h"
+
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -6,32 +8,217 @@
 #include <unistd.h>
 
 #include "definitions.h"
+#include "find.h"
 #include "highlight.h"
+#include "load.h"
+#include "matchIndex.h"
+#include "rowBuffer.h"
 #include "rowOperations.h"
+#include "terminal.h"
 
 /*** append buffer ***/
-struct abuf {
-  char *b;
-  int len;
-};
-
-#define ABUF_INIT \
-  { NULL, 0 }
-
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap * 2 : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
 void abFree(struct abuf *ab) { free(ab->b); }
+
+/*** screen buffer ***/
+// The frame is drawn into a grid of cells and compared with the grid of the
+// previous frame, so only cells that changed are sent to the terminal.
+#define ATTR_REVERSE 0x80  // Low bits hold the SGR colour, 0 for default
+
+struct screenCell {
+  char c;
+  unsigned char attr;
+};
+
+struct screenBuffer {
+  int rows, cols;
+  struct screenCell *prev;  // What the terminal currently shows
+  struct screenCell *next;  // The frame being drawn
+  int valid;                // prev matches the terminal
+  int rowoff, coloff;       // Viewport prev was drawn from
+  int fixed;                // Size set by editorSetScreenSize, not the tty
+};
+
+static struct screenBuffer screen = {0, 0, NULL, NULL, 0, 0, 0, 0};
+
+void editorWriteFrame(const char *buf, int len) {
+  write(STDOUT_FILENO, buf, len);
+}
+
+// Where finished frames go. The benchmark swaps in a counting sink.
+void (*editorFrameSink)(const char *buf, int len) = editorWriteFrame;
+
+void screenResize(int rows, int cols) {
+  screen.rows = rows;
+  screen.cols = cols;
+  free(screen.prev);
+  free(screen.next);
+  screen.prev = malloc(sizeof(struct screenCell) * rows * cols);
+  screen.next = malloc(sizeof(struct screenCell) * rows * cols);
+  screen.valid = 0;
+}
+
+void screenInvalidate() { screen.valid = 0; }
+
+void screenClear() {
+  for (int i = 0; i < screen.rows * screen.cols; i++) {
+    screen.next[i].c = ' ';
+    screen.next[i].attr = 0;
+  }
+}
+
+void screenPut(int y, int x, char c, unsigned char attr) {
+  if (y < 0 || y >= screen.rows || x < 0 || x >= screen.cols) return;
+  screen.next[y * screen.cols + x].c = c;
+  screen.next[y * screen.cols + x].attr = attr;
+}
+
+void screenPutString(int y, int x, const char *s, int len,
+                     unsigned char attr) {
+  for (int i = 0; i < len; i++) screenPut(y, x + i, s[i], attr);
+}
+
+void screenSetAttr(struct abuf *ab, unsigned char attr) {
+  char buf[16];
+  int len;
+  if (attr & ATTR_REVERSE)
+    len = snprintf(buf, sizeof(buf), "\x1b[0;7m");
+  else if (attr)
+    len = snprintf(buf, sizeof(buf), "\x1b[0;%dm", attr);
+  else
+    len = snprintf(buf, sizeof(buf), "\x1b[m");
+  abAppend(ab, buf, len);
+}
+
+int screenRowHasMultibyte(struct screenCell *row) {
+  for (int x = 0; x < screen.cols; x++)
+    if ((unsigned char)row[x].c >= 0x80) return 1;
+  return 0;
+}
+
+// Shifts rows [top, bottom) of the terminal up by n rows, or down if n is
+// negative, using a scroll region, and shifts prev to match. The rows that
+// scrolled in are blank and get drawn by the next flush.
+void screenScroll(struct abuf *ab, int top, int bottom, int n) {
+  if (!screen.valid || n == 0) return;
+  int height = bottom - top;
+  if (n >= height || -n >= height) return;
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c", top + 1, bottom,
+                     n > 0 ? n : -n, n > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+  abAppend(ab, "\x1b[r", 3);
+
+  int cols = screen.cols;
+  struct screenCell *area = &screen.prev[top * cols];
+  int keep = height - (n > 0 ? n : -n);
+  if (n > 0) {
+    memmove(area, &area[n * cols], sizeof(struct screenCell) * keep * cols);
+    area += keep * cols;
+  } else {
+    memmove(&area[-n * cols], area, sizeof(struct screenCell) * keep * cols);
+  }
+  for (int i = 0; i < (height - keep) * cols; i++) {
+    area[i].c = ' ';
+    area[i].attr = 0;
+  }
+}
+
+// Appends the escape sequences that turn prev into next, then makes next
+// the new prev.
+void screenFlush(struct abuf *ab) {
+  if (!screen.valid) {
+    abAppend(ab, "\x1b[m\x1b[2J", 7);
+    for (int i = 0; i < screen.rows * screen.cols; i++) {
+      screen.prev[i].c = ' ';
+      screen.prev[i].attr = 0;
+    }
+    screen.valid = 1;
+  }
+  int attr = 0;  // The terminal is left with default attributes after a flush
+  for (int y = 0; y < screen.rows; y++) {
+    struct screenCell *prev = &screen.prev[y * screen.cols];
+    struct screenCell *next = &screen.next[y * screen.cols];
+    if (!memcmp(prev, next, sizeof(struct screenCell) * screen.cols))
+      continue;
+    // Multibyte characters take fewer columns than bytes, so cell positions
+    // on such rows do not match terminal columns. Redraw them whole.
+    int whole = screenRowHasMultibyte(prev) || screenRowHasMultibyte(next);
+    int blank = screen.cols;  // Start of the blank tail of next
+    while (blank > 0 && next[blank - 1].c == ' ' && next[blank - 1].attr == 0)
+      blank--;
+    int x = 0;
+    int cursor = -1;  // Column the terminal cursor is at on this row
+    while (x < blank) {
+      if (!whole && prev[x].c == next[x].c && prev[x].attr == next[x].attr) {
+        x++;
+        continue;
+      }
+      if (cursor != x) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+        abAppend(ab, buf, len);
+      }
+      // Write through short unchanged gaps rather than moving the cursor.
+      int end = x;
+      int same = 0;
+      while (end < blank && same < 8) {
+        if (prev[end].c == next[end].c && prev[end].attr == next[end].attr)
+          same++;
+        else
+          same = 0;
+        end++;
+      }
+      end -= same;
+      if (whole) end = blank;
+      for (; x < end; x++) {
+        if (next[x].attr != attr) {
+          attr = next[x].attr;
+          screenSetAttr(ab, attr);
+        }
+        abAppend(ab, &next[x].c, 1);
+      }
+      cursor = x;
+    }
+    int tail = blank;
+    while (tail < screen.cols && prev[tail].c == ' ' && prev[tail].attr == 0)
+      tail++;
+    if (tail < screen.cols || whole) {
+      if (cursor != blank) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, blank + 1);
+        abAppend(ab, buf, len);
+      }
+      if (attr != 0) {
+        attr = 0;
+        screenSetAttr(ab, attr);
+      }
+      abAppend(ab, "\x1b[K", 3);
+    }
+  }
+  if (attr != 0) abAppend(ab, "\x1b[m", 3);
+  struct screenCell *swap = screen.prev;
+  screen.prev = screen.next;
+  screen.next = swap;
+}
+
 /*** output ***/
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx - COL_OFFSET) + COL_OFFSET;
+    E.rx = editorRowCxToRx(editorRow(E.cy), E.cx - COL_OFFSET) + COL_OFFSET;
   }
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
@@ -62,8 +249,15 @@ void editorDrawLineNumbers(char *row, int filerow) {
   row[2] = ' ';
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows() {
+  static unsigned char *overlay = NULL;
+  static int overlay_cap = 0;
+  if (overlay_cap < E.screencols) {
+    overlay_cap = E.screencols;
+    overlay = realloc(overlay, overlay_cap);
+  }
   int y;
+  editorHighlightRows(E.rowoff, E.rowoff + E.screenrows);
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
@@ -73,64 +267,45 @@ void editorDrawRows(struct abuf *ab) {
                                   "Avi editor -- version %s", AVI_VERSION);
         if (welcomelen > E.screencols) welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        if (padding) screenPut(y, 0, '~', 0);
+        screenPutString(y, padding, welcome, welcomelen, 0);
       } else {
-        abAppend(ab, "~", 1);
+        screenPut(y, 0, '~', 0);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *frow = editorRow(filerow);
+      int off = E.coloff - frow->roff;  // Long rows only render a window
+      int len = frow->rsize - off;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
+      char *c = &frow->render[off];
+      unsigned char *hl = &frow->hl[off];
+      int marked = editorFindOverlay(frow, E.coloff, len, overlay);
       int j;
-      char row[2];
+      char row[3];
       editorDrawLineNumbers(row, filerow);
-      abAppend(ab, row, 3);
+      screenPutString(y, 0, row, 3, 0);
       for (j = 0; j < len; j++) {
         if (iscntrl(c[j])) {
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
+          screenPut(y, COL_OFFSET + j, sym, ATTR_REVERSE);
+        } else if (marked && overlay[j]) {
+          screenPut(y, COL_OFFSET + j, c[j], editorSyntaxToColor(HL_MATCH));
         } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+          screenPut(y, COL_OFFSET + j, c[j], 0);
         } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          screenPut(y, COL_OFFSET + j, c[j], editorSyntaxToColor(hl[j]));
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
+void editorDrawStatusBar() {
+  int y = E.screenrows;
+  char status[80], rstatus[120], search[40] = "", load[20] = "";
+  if (editorMatchIndexStatus(search, sizeof(search) - 3)) strcat(search, " | ");
+  if (editorLoadStatus(load, sizeof(load) - 3)) strcat(load, " | ");
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s %s",
                      E.filename ? E.filename : "[No Name]", E.numrows,
                      E.dirty ? "(modified)" : "",
@@ -139,51 +314,73 @@ void editorDrawStatusBar(struct abuf *ab) {
                          : E.mode == NORMAL ? "--NORMAL--" : "--COMMAND--");
   int rlen =
       E.command_quantifier == 0
-          ? snprintf(rstatus, sizeof(rstatus), "%c | %s | %d/%d", E.prevCommand,
+          ? snprintf(rstatus, sizeof(rstatus), "%s%s%c | %s | %d/%d", load,
+                     search, E.prevCommand,
                      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
                      E.numrows)
-          : snprintf(rstatus, sizeof(rstatus), "%d%c | %s | %d/%d",
-                     E.command_quantifier, E.prevCommand,
+          : snprintf(rstatus, sizeof(rstatus), "%s%s%d%c | %s | %d/%d", load,
+                     search, E.command_quantifier, E.prevCommand,
                      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
                      E.numrows);
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols + COL_OFFSET) {
-    if (E.screencols + COL_OFFSET - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  int width = E.screencols + COL_OFFSET;
+  for (int x = 0; x < width; x++) screenPut(y, x, ' ', ATTR_REVERSE);
+  screenPutString(y, 0, status, len, ATTR_REVERSE);
+  if (len + rlen <= width)
+    screenPutString(y, width - rlen, rstatus, rlen, ATTR_REVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    screenPutString(E.screenrows + 1, 0, E.statusmsg, msglen, 0);
+}
+
+// Picks up a changed terminal size after SIGWINCH. The next frame is then
+// drawn in full.
+void editorCheckWindowSize() {
+  int rows, cols;
+  if (screen.fixed) return;
+  if (getWindowSizeIoctl(&rows, &cols) == -1) return;
+  if (rows == screen.rows && cols == screen.cols) return;
+  E.screenrows = rows - 2;
+  E.screencols = cols - COL_OFFSET;
+  screenResize(rows, cols);
+}
+
+// Draws into a screen of the given size without asking the terminal.
+void editorSetScreenSize(int rows, int cols) {
+  E.screenrows = rows - 2;
+  E.screencols = cols - COL_OFFSET;
+  screenResize(rows, cols);
+  screen.fixed = 1;
 }
 
 void editorRefreshScreen() {
+  // The first frame takes the size main got from the terminal.
+  if (!screen.prev) screenResize(E.screenrows + 2, E.screencols + COL_OFFSET);
   editorScroll();
+  screenClear();
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+
   struct abuf ab = ABUF_INIT;
   abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  // Rows that only moved are shifted by the terminal instead of redrawn.
+  if (E.coloff == screen.coloff)
+    screenScroll(&ab, 0, E.screenrows, E.rowoff - screen.rowoff);
+  screen.rowoff = E.rowoff;
+  screen.coloff = E.coloff;
+  screenFlush(&ab);
 
   char buf[32];
   snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
            (E.rx - E.coloff) + 1);
   abAppend(&ab, buf, strlen(buf));
   abAppend(&ab, "\x1b[?25h", 6);
-  write(STDOUT_FILENO, ab.b, ab.len);
+  editorFrameSink(ab.b, ab.len);
   abFree(&ab);
 }
 
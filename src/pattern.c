@@ -0,0 +1,742 @@
+#include "pattern.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Regular expressions are compiled to a Thompson NFA and matched by a DFA
+// whose states are built only as the text reaches them. Matching never
+// backtracks, so every scan is linear in the length of the line.
+//
+// `^` and `$` are assertions about the position between two bytes. Each
+// transition is keyed on the byte class and on whether the position it
+// lands on is a line boundary, so anchors are resolved while the epsilon
+// closure of the destination is taken.
+
+#define AT_BOL 1
+#define AT_EOL 2
+#define SET_WORDS (256 / 32)
+
+// The DFA cache is flushed when it grows past this many states, which
+// bounds memory on patterns whose DFA would be exponential.
+#define DFA_MAX_STATES 2048
+#define DFA_HASH_SIZE (DFA_MAX_STATES * 2)
+
+// Positions of a line remembered by the scan memo, see patternLongestMemo.
+#define SCAN_MEMO_MAX (1 << 22)
+// Bytes scanned between checks of the cancel flag.
+#define CANCEL_CHECK_BYTES (1 << 16)
+
+enum nfaType { NFA_SET, NFA_SPLIT, NFA_EPS, NFA_ASSERT, NFA_MATCH };
+
+struct nfaState {
+  int type;
+  int out;
+  int out1;
+  int set;  // symbol set for NFA_SET, AT_BOL or AT_EOL for NFA_ASSERT
+};
+
+struct symbolSet {
+  unsigned int bits[SET_WORDS];
+};
+
+struct dfaState {
+  int *nfa;
+  int nnfa;
+  int match;
+};
+
+struct scanMemo {
+  int pos;
+  int state;
+  int end;  // Longest match end reached from here, or -1
+  unsigned int gen;
+};
+
+struct dfa {
+  int nfa_start;
+  int unanchored;
+  int start[4];
+  struct dfaState *states;
+  int nstates;
+  int flushes;
+  int *next;
+  int hash[DFA_HASH_SIZE];
+};
+
+struct pattern {
+  const char *re;
+  int pos;
+  int error;
+
+  struct nfaState *states;
+  int nstates;
+  int capacity;
+  struct symbolSet *sets;
+  int nsets;
+  int setcap;
+
+  unsigned char classes[256];
+  int reps[256];
+  int nclasses;
+
+  int *stack;
+  int *mark;
+  int *scratch;
+  int gen;
+
+  int *starts;
+  int startcap;
+
+  int edges;  // Ends of the text that are line boundaries
+
+  struct dfa forward;
+  struct dfa reverse;
+
+  struct scanMemo *memo;  // Hash table of remembered forward scan states
+  int memocap;
+  int memolen;
+  unsigned int memogen;  // Entries of other generations are empty
+  int memoflushes;       // Forward DFA flushes the memo is valid for
+  int *path;             // Position and state pairs of the current scan
+  int pathcap;
+
+  const atomic_int *cancel;
+};
+
+struct fragment {
+  int start;
+  int end;
+};
+
+/*** symbol sets ***/
+void setAdd(struct symbolSet *s, int sym) {
+  s->bits[sym / 32] |= 1u << (sym % 32);
+}
+
+int setHas(struct symbolSet *s, int sym) {
+  return (s->bits[sym / 32] >> (sym % 32)) & 1;
+}
+
+void setAddRange(struct symbolSet *s, int from, int to) {
+  for (int c = from; c <= to; c++) setAdd(s, c);
+}
+
+// Adds the class named by a backslash escape; returns 0 if `c` names none.
+int setAddEscape(struct symbolSet *s, int c) {
+  struct symbolSet t = {{0}};
+  int negate = c == 'D' || c == 'W' || c == 'S';
+  switch (c | 0x20) {
+    case 'd':
+      setAddRange(&t, '0', '9');
+      break;
+    case 'w':
+      setAddRange(&t, '0', '9');
+      setAddRange(&t, 'a', 'z');
+      setAddRange(&t, 'A', 'Z');
+      setAdd(&t, '_');
+      break;
+    case 's':
+      setAdd(&t, ' ');
+      setAddRange(&t, '\t', '\r');
+      break;
+    default:
+      return 0;
+  }
+  for (int i = 0; i < 256; i++)
+    if (setHas(&t, i) != negate) setAdd(s, i);
+  return 1;
+}
+
+/*** nfa ***/
+int nfaNewState(struct pattern *p, int type, int out, int out1) {
+  if (p->nstates == p->capacity) {
+    p->capacity = p->capacity ? p->capacity * 2 : 64;
+    p->states = realloc(p->states, sizeof(struct nfaState) * p->capacity);
+  }
+  struct nfaState *s = &p->states[p->nstates];
+  s->type = type;
+  s->out = out;
+  s->out1 = out1;
+  s->set = -1;
+  return p->nstates++;
+}
+
+int nfaNewSet(struct pattern *p) {
+  if (p->nsets == p->setcap) {
+    p->setcap = p->setcap ? p->setcap * 2 : 16;
+    p->sets = realloc(p->sets, sizeof(struct symbolSet) * p->setcap);
+  }
+  memset(&p->sets[p->nsets], 0, sizeof(struct symbolSet));
+  return p->nsets++;
+}
+
+struct fragment nfaEmpty(struct pattern *p) {
+  int s = nfaNewState(p, NFA_EPS, -1, -1);
+  return (struct fragment){s, s};
+}
+
+struct fragment nfaSymbols(struct pattern *p, int set) {
+  int end = nfaNewState(p, NFA_EPS, -1, -1);
+  int s = nfaNewState(p, NFA_SET, end, -1);
+  p->states[s].set = set;
+  return (struct fragment){s, end};
+}
+
+struct fragment nfaLiteral(struct pattern *p, int c) {
+  int set = nfaNewSet(p);
+  setAdd(&p->sets[set], c);
+  return nfaSymbols(p, set);
+}
+
+struct fragment nfaAssert(struct pattern *p, int kind) {
+  int end = nfaNewState(p, NFA_EPS, -1, -1);
+  int s = nfaNewState(p, NFA_ASSERT, end, -1);
+  p->states[s].set = kind;
+  return (struct fragment){s, end};
+}
+
+/*** parser ***/
+struct fragment parseAlternation(struct pattern *p, int reverse);
+
+int parsePeek(struct pattern *p) { return (unsigned char)p->re[p->pos]; }
+
+struct fragment parseClass(struct pattern *p) {
+  int set = nfaNewSet(p);
+  struct symbolSet s = {{0}};
+  int negate = 0;
+  if (parsePeek(p) == '^') {
+    negate = 1;
+    p->pos++;
+  }
+  int first = 1;
+  while (parsePeek(p) && (first || parsePeek(p) != ']')) {
+    int c = parsePeek(p);
+    p->pos++;
+    first = 0;
+    if (c == '\\' && parsePeek(p)) {
+      c = parsePeek(p);
+      p->pos++;
+      if (setAddEscape(&s, c)) continue;
+      if (c == 't') c = '\t';
+    }
+    if (parsePeek(p) == '-' && p->re[p->pos + 1] &&
+        p->re[p->pos + 1] != ']') {
+      int to = (unsigned char)p->re[p->pos + 1];
+      p->pos += 2;
+      if (to >= c) setAddRange(&s, c, to);
+    } else {
+      setAdd(&s, c);
+    }
+  }
+  if (parsePeek(p) != ']') {
+    p->error = 1;
+    return nfaEmpty(p);
+  }
+  p->pos++;
+  for (int i = 0; i < 256; i++)
+    if (setHas(&s, i) != negate) setAdd(&p->sets[set], i);
+  return nfaSymbols(p, set);
+}
+
+struct fragment parseAtom(struct pattern *p, int reverse) {
+  int c = parsePeek(p);
+  p->pos++;
+  switch (c) {
+    case '(': {
+      struct fragment f = parseAlternation(p, reverse);
+      if (parsePeek(p) == ')')
+        p->pos++;
+      else
+        p->error = 1;
+      return f;
+    }
+    case '[':
+      return parseClass(p);
+    case '.': {
+      int set = nfaNewSet(p);
+      setAddRange(&p->sets[set], 0, 255);
+      return nfaSymbols(p, set);
+    }
+    case '^':
+      return nfaAssert(p, AT_BOL);
+    case '$':
+      return nfaAssert(p, AT_EOL);
+    case '\\': {
+      c = parsePeek(p);
+      if (!c) return nfaLiteral(p, '\\');
+      p->pos++;
+      int set = nfaNewSet(p);
+      if (setAddEscape(&p->sets[set], c)) return nfaSymbols(p, set);
+      setAdd(&p->sets[set], c == 't' ? '\t' : c);
+      return nfaSymbols(p, set);
+    }
+    default:
+      return nfaLiteral(p, c);
+  }
+}
+
+struct fragment parseRepeat(struct pattern *p, int reverse) {
+  struct fragment f = parseAtom(p, reverse);
+  while (1) {
+    int c = parsePeek(p);
+    if (c != '*' && c != '+' && c != '?') return f;
+    p->pos++;
+    int end = nfaNewState(p, NFA_EPS, -1, -1);
+    int split = nfaNewState(p, NFA_SPLIT, f.start, end);
+    if (c == '*') {
+      p->states[f.end].out = split;
+      f.start = split;
+    } else if (c == '+') {
+      p->states[f.end].out = split;
+    } else {
+      p->states[f.end].out = end;
+      f.start = split;
+    }
+    f.end = end;
+  }
+}
+
+// The reverse automaton used to find where a match starts is built from
+// the same pattern by joining each sequence back to front.
+struct fragment parseConcatenation(struct pattern *p, int reverse) {
+  struct fragment f = nfaEmpty(p);
+  while (parsePeek(p) && parsePeek(p) != '|' && parsePeek(p) != ')') {
+    struct fragment g = parseRepeat(p, reverse);
+    if (reverse) {
+      p->states[g.end].out = f.start;
+      f.start = g.start;
+    } else {
+      p->states[f.end].out = g.start;
+      f.end = g.end;
+    }
+  }
+  return f;
+}
+
+struct fragment parseAlternation(struct pattern *p, int reverse) {
+  struct fragment f = parseConcatenation(p, reverse);
+  while (parsePeek(p) == '|') {
+    p->pos++;
+    struct fragment g = parseConcatenation(p, reverse);
+    int end = nfaNewState(p, NFA_EPS, -1, -1);
+    int split = nfaNewState(p, NFA_SPLIT, f.start, g.start);
+    p->states[f.end].out = end;
+    p->states[g.end].out = end;
+    f = (struct fragment){split, end};
+  }
+  return f;
+}
+
+int parsePattern(struct pattern *p, int reverse) {
+  p->pos = 0;
+  struct fragment f = parseAlternation(p, reverse);
+  if (parsePeek(p)) p->error = 1;
+  p->states[f.end].out = nfaNewState(p, NFA_MATCH, -1, -1);
+  return f.start;
+}
+
+// Splits the bytes into classes that every set treats alike, so DFA
+// transition rows only need one entry per class.
+void patternBuildClasses(struct pattern *p) {
+  memset(p->classes, 0, sizeof(p->classes));
+  p->nclasses = 1;
+  for (int s = 0; s < p->nsets; s++) {
+    int split[512];
+    memset(split, -1, sizeof(int) * p->nclasses * 2);
+    int n = 0;
+    for (int c = 0; c < 256; c++) {
+      int key = p->classes[c] * 2 + setHas(&p->sets[s], c);
+      if (split[key] == -1) split[key] = n++;
+      p->classes[c] = split[key];
+    }
+    p->nclasses = n;
+  }
+  for (int c = 255; c >= 0; c--) p->reps[p->classes[c]] = c;
+}
+
+/*** dfa ***/
+// Adds the states reachable from `id` without consuming input, at a
+// position described by the AT_ flags in `at`.
+void nfaClosure(struct pattern *p, int id, int at, int *out, int *n) {
+  int top = 0;
+  p->stack[top++] = id;
+  while (top) {
+    int s = p->stack[--top];
+    if (s < 0 || p->mark[s] == p->gen) continue;
+    p->mark[s] = p->gen;
+    struct nfaState *st = &p->states[s];
+    if (st->type == NFA_SPLIT) {
+      p->stack[top++] = st->out1;
+      p->stack[top++] = st->out;
+    } else if (st->type == NFA_EPS) {
+      p->stack[top++] = st->out;
+    } else if (st->type == NFA_ASSERT) {
+      if (at & st->set) p->stack[top++] = st->out;
+    } else {
+      out[(*n)++] = s;
+    }
+  }
+}
+
+int compareInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+unsigned int dfaHash(int *set, int n) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+  return h;
+}
+
+void dfaFlush(struct dfa *d) {
+  for (int i = 0; i < d->nstates; i++) free(d->states[i].nfa);
+  d->nstates = 0;
+  d->flushes++;
+  memset(d->start, -1, sizeof(d->start));
+  memset(d->hash, -1, sizeof(d->hash));
+}
+
+// Returns the DFA state for a set of NFA states, adding it if needed.
+int dfaState(struct pattern *p, struct dfa *d, int *set, int n) {
+  qsort(set, n, sizeof(int), compareInt);
+  unsigned int h = dfaHash(set, n) % DFA_HASH_SIZE;
+  while (d->hash[h] != -1) {
+    struct dfaState *s = &d->states[d->hash[h]];
+    if (s->nnfa == n && !memcmp(s->nfa, set, sizeof(int) * n))
+      return d->hash[h];
+    h = (h + 1) % DFA_HASH_SIZE;
+  }
+  if (d->nstates == DFA_MAX_STATES) {
+    dfaFlush(d);
+    return dfaState(p, d, set, n);
+  }
+  int id = d->nstates++;
+  struct dfaState *s = &d->states[id];
+  s->nfa = malloc(sizeof(int) * (n ? n : 1));
+  memcpy(s->nfa, set, sizeof(int) * n);
+  s->nnfa = n;
+  s->match = 0;
+  for (int i = 0; i < n; i++)
+    if (p->states[set[i]].type == NFA_MATCH) s->match = 1;
+  memset(&d->next[id * p->nclasses * 2], -1, sizeof(int) * p->nclasses * 2);
+  d->hash[h] = id;
+  return id;
+}
+
+int dfaStart(struct pattern *p, struct dfa *d, int at) {
+  if (d->start[at] == -1) {
+    int n = 0;
+    p->gen++;
+    nfaClosure(p, d->nfa_start, at, p->scratch, &n);
+    d->start[at] = dfaState(p, d, p->scratch, n);
+  }
+  return d->start[at];
+}
+
+// Consumes byte `c`, landing on a position that is a line boundary when
+// `edge` is set.
+int dfaStep(struct pattern *p, struct dfa *d, int state, unsigned char c,
+            int edge) {
+  int cls = p->classes[c];
+  int slot = state * p->nclasses * 2 + cls * 2 + edge;
+  int next = d->next[slot];
+  if (next != -1) return next;
+
+  // Forward scans land on the line end, reverse scans on the line start.
+  int at = edge ? (d->unanchored ? AT_BOL : AT_EOL) : 0;
+
+  int n = 0;
+  p->gen++;
+  struct dfaState *s = &d->states[state];
+  for (int i = 0; i < s->nnfa; i++) {
+    struct nfaState *st = &p->states[s->nfa[i]];
+    if (st->type == NFA_SET && setHas(&p->sets[st->set], p->reps[cls]))
+      nfaClosure(p, st->out, at, p->scratch, &n);
+  }
+  // An unanchored DFA may start a new match at every position.
+  if (d->unanchored) nfaClosure(p, d->nfa_start, at, p->scratch, &n);
+  int flushes = d->flushes;
+  next = dfaState(p, d, p->scratch, n);
+  // A flush drops the state we came from, so there is no row to fill in.
+  if (d->flushes == flushes) d->next[slot] = next;
+  return next;
+}
+
+void dfaInit(struct pattern *p, struct dfa *d, int start, int unanchored) {
+  d->nfa_start = start;
+  d->unanchored = unanchored;
+  d->states = malloc(sizeof(struct dfaState) * DFA_MAX_STATES);
+  d->next = malloc(sizeof(int) * DFA_MAX_STATES * p->nclasses * 2);
+  d->nstates = 0;
+  dfaFlush(d);
+}
+
+/*** pattern ***/
+struct pattern *patternCompile(const char *re) {
+  struct pattern *p = calloc(1, sizeof(struct pattern));
+  p->re = re;
+  int forward = parsePattern(p, 0);
+  int reverse = parsePattern(p, 1);
+  if (p->error) {
+    patternFree(p);
+    return NULL;
+  }
+  p->re = NULL;
+  patternBuildClasses(p);
+  p->stack = malloc(sizeof(int) * (p->nstates * 2 + 1));
+  p->mark = calloc(p->nstates, sizeof(int));
+  p->scratch = malloc(sizeof(int) * p->nstates);
+  p->edges = AT_BOL | AT_EOL;
+  dfaInit(p, &p->forward, forward, 0);
+  dfaInit(p, &p->reverse, reverse, 1);
+  return p;
+}
+
+void patternFree(struct pattern *p) {
+  if (!p) return;
+  if (p->forward.states) {
+    dfaFlush(&p->forward);
+    dfaFlush(&p->reverse);
+  }
+  free(p->forward.states);
+  free(p->forward.next);
+  free(p->reverse.states);
+  free(p->reverse.next);
+  free(p->states);
+  free(p->sets);
+  free(p->stack);
+  free(p->mark);
+  free(p->scratch);
+  free(p->starts);
+  free(p->memo);
+  free(p->path);
+  free(p);
+}
+
+// Makes long scans give up early once *cancel is set.
+void patternSetCancel(struct pattern *p, const atomic_int *cancel) {
+  p->cancel = cancel;
+}
+
+int patternCancelled(struct pattern *p, int pos) {
+  return p->cancel && pos % CANCEL_CHECK_BYTES == 0 &&
+         atomic_load_explicit(p->cancel, memory_order_relaxed);
+}
+
+/*** matching ***/
+int patternAt(struct pattern *p, int len, int pos) {
+  return ((pos == 0 ? AT_BOL : 0) | (pos == len ? AT_EOL : 0)) & p->edges;
+}
+
+// Runs the reverse DFA from the end of the line. Whenever it accepts, a
+// match starts at that position. Returns the first (leftmost) or, with
+// `last`, the final start in [lo, hi], or -1.
+int patternScanStarts(struct pattern *p, const char *text, int len, int lo,
+                      int hi, int last) {
+  struct dfa *d = &p->reverse;
+  int state = dfaStart(p, d, patternAt(p, len, len));
+  int best = -1;
+  if (d->states[state].match && len <= hi) {
+    best = len;
+    if (last) return best;
+  }
+  for (int pos = len - 1; pos >= lo; pos--) {
+    state = dfaStep(p, d, state, text[pos], pos == 0 && p->edges & AT_BOL);
+    if (d->states[state].match && pos <= hi) {
+      best = pos;
+      if (last) return best;
+    }
+  }
+  return best;
+}
+
+// Runs the forward DFA from a match start and returns where the longest
+// match ends.
+int patternLongest(struct pattern *p, const char *text, int len, int pos) {
+  struct dfa *d = &p->forward;
+  int state = dfaStart(p, d, patternAt(p, len, pos));
+  int end = pos;
+  for (; pos < len; pos++) {
+    state = dfaStep(p, d, state, text[pos],
+                    pos + 1 == len && p->edges & AT_EOL);
+    if (d->states[state].nnfa == 0) break;
+    if (d->states[state].match) end = pos + 1;
+  }
+  return end;
+}
+
+// Finds the leftmost-longest match that starts at or after `col`.
+int patternMatch(struct pattern *p, const char *text, int len, int col,
+                 int *start, int *end) {
+  if (col > len) return 0;
+  int pos = patternScanStarts(p, text, len, col < 0 ? 0 : col, len, 0);
+  if (pos == -1) return 0;
+  *start = pos;
+  *end = patternLongest(p, text, len, pos);
+  return 1;
+}
+
+// As patternMatch, for text that is only part of a line. `^` matches at its
+// start only if bol is set, and `$` at its end only if eol is set.
+int patternMatchWindow(struct pattern *p, const char *text, int len, int col,
+                       int bol, int eol, int *start, int *end) {
+  p->edges = (bol ? AT_BOL : 0) | (eol ? AT_EOL : 0);
+  int found = patternMatch(p, text, len, col, start, end);
+  p->edges = AT_BOL | AT_EOL;
+  return found;
+}
+
+// Finds the last match that starts at or after `from` and before `col`.
+int patternMatchLast(struct pattern *p, const char *text, int len, int from,
+                     int col, int *start, int *end) {
+  if (col <= 0 || from > len) return 0;
+  int hi = col <= len ? col - 1 : len;
+  int pos = patternScanStarts(p, text, len, from < 0 ? 0 : from, hi, 1);
+  if (pos == -1) return 0;
+  *start = pos;
+  *end = patternLongest(p, text, len, pos);
+  return 1;
+}
+
+// Collects every position in the line where a match starts, in one reverse
+// scan. They are left in p->starts from last to first; returns the count.
+int patternCollectStarts(struct pattern *p, const char *text, int len) {
+  struct dfa *d = &p->reverse;
+  int state = dfaStart(p, d, patternAt(p, len, len));
+  int n = 0;
+  for (int pos = len; pos >= 0; pos--) {
+    if (patternCancelled(p, pos)) return 0;
+    if (pos < len)
+      state = dfaStep(p, d, state, text[pos], pos == 0 && p->edges & AT_BOL);
+    if (!d->states[state].match) continue;
+    if (n == p->startcap) {
+      p->startcap = p->startcap ? p->startcap * 2 : 64;
+      p->starts = realloc(p->starts, sizeof(int) * p->startcap);
+    }
+    p->starts[n++] = pos;
+  }
+  return n;
+}
+
+/*** scan memo ***/
+// The forward scan that finds the longest match from a start runs on until
+// the DFA dies, which can be far past where the match ends, as for \w+x|\w
+// on a long word. A later scan that reaches the same DFA state at the same
+// position goes on exactly as the earlier one did, so the longest end found
+// from there is remembered. Each pair is then scanned once per line, which
+// keeps finding all the matches of a line linear in its length. Only the
+// part of a scan past its last match end is remembered, as the next match
+// starts there.
+void memoClear(struct pattern *p) {
+  if (++p->memogen == 0) {
+    memset(p->memo, 0, sizeof(struct scanMemo) * p->memocap);
+    p->memogen = 1;
+  }
+  p->memolen = 0;
+  p->memoflushes = p->forward.flushes;
+}
+
+struct scanMemo *memoSlot(struct pattern *p, int pos, int state) {
+  unsigned int mask = p->memocap - 1;
+  unsigned int h = ((unsigned int)pos * 2654435761u ^ state) & mask;
+  while (p->memo[h].gen == p->memogen &&
+         (p->memo[h].pos != pos || p->memo[h].state != state))
+    h = (h + 1) & mask;
+  return &p->memo[h];
+}
+
+// Returns the remembered end for state at pos, -1 if no match end is
+// reached from there, or -2 if the pair was not scanned yet.
+int memoFind(struct pattern *p, int pos, int state) {
+  if (p->memolen == 0) return -2;
+  struct scanMemo *m = memoSlot(p, pos, state);
+  return m->gen == p->memogen ? m->end : -2;
+}
+
+void memoAdd(struct pattern *p, int pos, int state, int end) {
+  if (p->memolen * 2 >= p->memocap) {
+    if (p->memolen >= SCAN_MEMO_MAX) return;
+    struct scanMemo *old = p->memo;
+    int oldcap = p->memocap;
+    p->memocap = oldcap ? oldcap * 2 : 1024;
+    p->memo = calloc(p->memocap, sizeof(struct scanMemo));
+    for (int i = 0; i < oldcap; i++)
+      if (old[i].gen == p->memogen)
+        *memoSlot(p, old[i].pos, old[i].state) = old[i];
+    free(old);
+  }
+  struct scanMemo *m = memoSlot(p, pos, state);
+  if (m->gen != p->memogen) p->memolen++;
+  *m = (struct scanMemo){pos, state, end, p->memogen};
+}
+
+// As patternLongest, but stops where an earlier scan of the line went on
+// from and remembers its own way for later ones.
+int patternLongestMemo(struct pattern *p, const char *text, int len,
+                       int pos) {
+  struct dfa *d = &p->forward;
+  if (p->memoflushes != d->flushes) memoClear(p);
+  int flushes = d->flushes;
+  int state = dfaStart(p, d, patternAt(p, len, pos));
+  int end = pos;
+  int known = -2;
+  int n = 0;
+  int complete = 1;  // The path holds the whole scan past end
+  for (int at = pos;; at++) {
+    known = memoFind(p, at, state);
+    if (known != -2) break;
+    if (d->states[state].match) {
+      end = at;
+      n = 0;
+      complete = 1;
+    }
+    if (n == SCAN_MEMO_MAX) complete = 0;
+    if (complete) {
+      if (n * 2 == p->pathcap) {
+        p->pathcap = p->pathcap ? p->pathcap * 2 : 256;
+        p->path = realloc(p->path, sizeof(int) * p->pathcap);
+      }
+      p->path[n * 2] = at;
+      p->path[n * 2 + 1] = state;
+      n++;
+    }
+    if (at == len) break;
+    if (patternCancelled(p, at)) return end;
+    state = dfaStep(p, d, state, text[at], at + 1 == len && p->edges & AT_EOL);
+    if (d->states[state].nnfa == 0) break;
+  }
+  if (known >= 0) end = known;
+  // A flush renumbered the states, so the path no longer names them.
+  if (d->flushes != flushes) {
+    memoClear(p);
+    return end;
+  }
+  if (!complete) return end;
+  int r = known >= 0 ? known : -1;
+  for (int i = n - 1; i >= 0; i--) {
+    if (r == -1 && d->states[p->path[i * 2 + 1]].match) r = p->path[i * 2];
+    memoAdd(p, p->path[i * 2], p->path[i * 2 + 1], r);
+  }
+  return end;
+}
+
+// Reports the successive non-overlapping leftmost-longest matches of the
+// line. As in vi, an empty match right where the previous match ended is
+// skipped.
+void patternMatchAll(struct pattern *p, const char *text, int len,
+                     void (*report)(void *arg, int start, int end),
+                     void *arg) {
+  memoClear(p);
+  int n = patternCollectStarts(p, text, len);
+  int next = 0, prev = -1;
+  while (n > 0) {
+    int start = p->starts[--n];
+    if (start < next) continue;
+    int end = patternLongestMemo(p, text, len, start);
+    if (end == start && start == prev) continue;
+    report(arg, start, end);
+    prev = end;
+    next = end > start ? end : start + 1;
+  }
+}
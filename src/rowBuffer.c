@@ -0,0 +1,70 @@
+#include "rowBuffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "terminal.h"
+
+/*** row buffer ***/
+// Rows live in one array with a gap of unused slots at the last edit
+// position. Inserting or deleting at the gap is O(1); moving the gap costs
+// only the number of rows between the old and the new edit position.
+
+erow *editorRow(int at) {
+  struct rowBuffer *b = &E.rowbuf;
+  if (at < 0 || at >= E.numrows) return NULL;
+  return &b->rows[at < b->gap ? at : at + b->gaplen];
+}
+
+int editorRowIndex(erow *row) {
+  struct rowBuffer *b = &E.rowbuf;
+  int i = row - b->rows;
+  return i < b->gap ? i : i - b->gaplen;
+}
+
+void editorRowBufferMoveGap(int at) {
+  struct rowBuffer *b = &E.rowbuf;
+  if (at < b->gap) {
+    memmove(&b->rows[at + b->gaplen], &b->rows[at],
+            sizeof(erow) * (b->gap - at));
+  } else if (at > b->gap) {
+    memmove(&b->rows[b->gap], &b->rows[b->gap + b->gaplen],
+            sizeof(erow) * (at - b->gap));
+  }
+  b->gap = at;
+}
+
+void editorRowBufferGrow() {
+  struct rowBuffer *b = &E.rowbuf;
+  int oldcap = E.numrows + b->gaplen;
+  int newcap = oldcap ? oldcap * 2 : 64;
+  erow *rows = realloc(b->rows, sizeof(erow) * newcap);
+  if (rows == NULL) die("realloc");
+  int tail = E.numrows - b->gap;
+  memmove(&rows[newcap - tail], &rows[oldcap - tail], sizeof(erow) * tail);
+  b->rows = rows;
+  b->gaplen += newcap - oldcap;
+}
+
+// Returns the uninitialised slot for the new row at index at.
+erow *editorRowBufferInsert(int at) {
+  struct rowBuffer *b = &E.rowbuf;
+  if (b->gaplen == 0) editorRowBufferGrow();
+  editorRowBufferMoveGap(at);
+  b->gap++;
+  b->gaplen--;
+  E.numrows++;
+  if (E.gaprow >= at) E.gaprow++;
+  return &b->rows[at];
+}
+
+void editorRowBufferDelete(int at) {
+  struct rowBuffer *b = &E.rowbuf;
+  editorRowBufferMoveGap(at);
+  b->gaplen++;
+  E.numrows--;
+  if (E.gaprow == at)
+    E.gaprow = -1;
+  else if (E.gaprow > at)
+    E.gaprow--;
+}
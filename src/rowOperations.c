@@ -2,104 +2,420 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "highlight.h"
+#include "rowBuffer.h"
+#include "save.h"
+
+/*** prototypes ***/
+void editorRenderRow(erow *row);
+void editorRowReserve(erow *row, int size);
 
 /*** row operations ***/
+// Returns the number of tabs in row before cx.
+int editorRowTabsBefore(erow *row, int cx) {
+  int lo = 0, hi = row->ntabs;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->tabs[mid].cx < cx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Render column at which tab k starts.
+int editorRowTabStart(erow *row, int k) {
+  if (k == 0) return row->tabs[0].cx;
+  return row->tabs[k - 1].rx + row->tabs[k].cx - row->tabs[k - 1].cx - 1;
+}
+
+int editorRowCxToRxIndexed(erow *row, int cx) {
+  int k = editorRowTabsBefore(row, cx);
+  if (k == 0) return cx;
+  return row->tabs[k - 1].rx + cx - row->tabs[k - 1].cx - 1;
+}
+
+int editorRowRxToCxIndexed(erow *row, int rx) {
+  int lo = 0, hi = row->ntabs;  // Find the first tab starting after rx
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (editorRowTabStart(row, mid) <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int cx;
+  if (lo == 0) {
+    cx = rx;
+  } else {
+    struct tabStop *tab = &row->tabs[lo - 1];
+    cx = rx < tab->rx ? tab->cx : tab->cx + 1 + rx - tab->rx;
+  }
+  return cx < row->size ? cx : row->size;
+}
+
 int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx += (AVI_TAB_STOP - 1) - (rx % AVI_TAB_STOP);
+  if (row->render == NULL) editorRenderRow(row);
+  return editorRowCxToRxIndexed(row, cx);
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->render == NULL) editorRenderRow(row);
+  return editorRowRxToCxIndexed(row, rx);
+}
+
+/*** long rows ***/
+// Rows of AVI_LONG_LINE bytes or more are typed into through a gap at the
+// last edit, so a keystroke does not move the rest of the row. Their render
+// and hl only cover a window around E.coloff.
+#define LONG_LINE_MARGIN 1024
+
+// Returns the row text, closing the gap first if the row has one.
+char *editorRowChars(erow *row) {
+  if (row->gap >= 0) {
+    int hole = row->capacity - row->size;
+    memmove(&row->chars[row->gap], &row->chars[row->gap + hole],
+            row->size - row->gap);
+    row->chars[row->size] = '\0';
+    row->gap = -1;
+    E.gaprow = -1;
+  }
+  return row->chars;
+}
+
+// Closes the text gap of whichever row has one.
+void editorCloseGap() {
+  if (E.gaprow >= 0) editorRowChars(editorRow(E.gaprow));
+}
+
+char editorRowCharAt(erow *row, int at) {
+  if (row->gap < 0 || at < row->gap) return row->chars[at];
+  return row->chars[at + row->capacity - row->size];
+}
+
+// Only one row has a gap at a time, so finding the open gap is O(1).
+void editorRowMoveGap(erow *row, int at) {
+  if (row->gap < 0) {
+    editorCloseGap();
+    editorRowReserve(row, row->size + 2);
+    row->gap = row->size;
+    E.gaprow = editorRowIndex(row);
+  }
+  int hole = row->capacity - row->size;
+  if (hole < 2) {
+    int capacity = row->capacity * 2;
+    int tail = row->size - row->gap;
+    row->chars = realloc(row->chars, capacity);
+    memmove(&row->chars[capacity - tail], &row->chars[row->capacity - tail],
+            tail);
+    row->capacity = capacity;
+    hole = capacity - row->size;
+  }
+  if (at < row->gap)
+    memmove(&row->chars[at + hole], &row->chars[at], row->gap - at);
+  else if (at > row->gap)
+    memmove(&row->chars[row->gap], &row->chars[row->gap + hole],
+            at - row->gap);
+  row->gap = at;
+}
+
+// Rebuilds the render window of a long row around E.coloff.
+void editorRenderWindow(erow *row) {
+  int start = E.coloff - LONG_LINE_MARGIN;
+  if (start < 0) start = 0;
+  int cx = editorRowRxToCxIndexed(row, start);
+  int rx = editorRowCxToRxIndexed(row, cx);
+  int width = E.screencols + 2 * LONG_LINE_MARGIN;
+  row->render = realloc(row->render, width + AVI_TAB_STOP + 1);
+  int idx = 0;
+  while (cx < row->size && idx < width) {
+    char c = editorRowCharAt(row, cx++);
+    if (c == '\t') {
+      row->render[idx++] = ' ';
+      while ((rx + idx) % AVI_TAB_STOP != 0) row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = c;
     }
-    rx++;
   }
-  return rx;
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  row->roff = rx;
+  row->hl_in = -1;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (AVI_TAB_STOP - 1) - (cur_rx % AVI_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
+int editorRenderWindowCovers(erow *row) {
+  if (row->roff < 0 || E.coloff < row->roff) return 0;
+  if (E.coloff + E.screencols <= row->roff + row->rsize) return 1;
+  return row->roff + row->rsize >= editorRowCxToRxIndexed(row, row->size);
+}
+
+// Keeps the tab index of a long row in step with a non-tab character
+// inserted at cx (delta 1) or removed from cx (delta -1). Like in render,
+// the next tab absorbs the shift unless it wraps to another tab stop.
+void editorRowShiftTabs(erow *row, int cx, int delta) {
+  int k = editorRowTabsBefore(row, cx);
+  if (k == row->ntabs) return;
+  int width = row->tabs[k].rx - editorRowTabStart(row, k);
+  int wrap = 0;
+  if (delta > 0 && width == 1) wrap = AVI_TAB_STOP;
+  if (delta < 0 && width == AVI_TAB_STOP) wrap = -AVI_TAB_STOP;
+  for (int j = k; j < row->ntabs; j++) {
+    row->tabs[j].cx += delta;
+    row->tabs[j].rx += wrap;
   }
-  return cx;
 }
 
-void editorUpdateRow(erow *row) {
+void editorRenderRow(erow *row) {
   int tabs = 0;
   int j;
+  char *chars = editorRowChars(row);
   for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+    if (chars[j] == '\t') tabs++;
+  row->tabs = realloc(row->tabs, sizeof(struct tabStop) * tabs);
+  row->ntabs = tabs;
+
+  if (row->size >= AVI_LONG_LINE) {
+    int rx = 0;
+    tabs = 0;
+    for (j = 0; j < row->size; j++) {
+      if (chars[j] == '\t') {
+        rx += AVI_TAB_STOP - rx % AVI_TAB_STOP;
+        row->tabs[tabs].cx = j;
+        row->tabs[tabs].rx = rx;
+        tabs++;
+      } else {
+        rx++;
+      }
+    }
+    row->rwindow = 1;
+    editorRenderWindow(row);
+    return;
+  }
+
   free(row->render);
   row->render = malloc(row->size + tabs * (AVI_TAB_STOP - 1) + 1);
+  row->roff = 0;
+  row->rwindow = 0;
   int idx = 0;
+  tabs = 0;
   for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
+    if (chars[j] == '\t') {
       row->render[idx++] = ' ';
       while (idx % AVI_TAB_STOP != 0) row->render[idx++] = ' ';
+      row->tabs[tabs].cx = j;
+      row->tabs[tabs].rx = idx;
+      tabs++;
     } else {
-      row->render[idx++] = row->chars[j];
+      row->render[idx++] = chars[j];
     }
   }
   row->render[idx] = '\0';
   row->rsize = idx;
-  editorUpdateSyntax(row);
+}
+
+// Marks hl stale after the text of row changed.
+void editorRowChanged(erow *row) {
+  row->hl_in = -1;
+  editorInvalidateSyntax(editorRowIndex(row));
+}
+
+// Patches render and the tab index for a non-tab character that was just
+// inserted at cx. The first tab after it absorbs the shift, so the rest of
+// the row keeps its columns. Returns 0 if that tab would overflow to the
+// next tab stop and render has to be rebuilt.
+int editorRenderInsertChar(erow *row, int cx) {
+  int k = editorRowTabsBefore(row, cx);
+  int rx = k == 0 ? cx : row->tabs[k - 1].rx + cx - row->tabs[k - 1].cx - 1;
+  int end = row->rsize;  // Render column where the shift is absorbed
+  if (k < row->ntabs) {
+    if (row->tabs[k].rx - editorRowTabStart(row, k) == 1) return 0;
+    end = row->tabs[k].rx - 1;
+  } else {
+    char *render = realloc(row->render, row->rsize + 2);
+    if (render == NULL) return 0;
+    row->render = render;
+    row->rsize++;
+    row->render[row->rsize] = '\0';
+  }
+  memmove(&row->render[rx + 1], &row->render[rx], end - rx);
+  row->render[rx] = row->chars[cx];
+  for (int j = k; j < row->ntabs; j++) row->tabs[j].cx++;
+  return 1;
+}
+
+// Counterpart of editorRenderInsertChar for a non-tab character that was
+// just removed from cx.
+int editorRenderDelChar(erow *row, int cx) {
+  int k = editorRowTabsBefore(row, cx);
+  int rx = k == 0 ? cx : row->tabs[k - 1].rx + cx - row->tabs[k - 1].cx - 1;
+  int end = row->rsize - 1;
+  if (k < row->ntabs) {
+    if (row->tabs[k].rx - editorRowTabStart(row, k) == AVI_TAB_STOP) return 0;
+    end = row->tabs[k].rx - 1;
+  } else {
+    row->rsize--;
+  }
+  memmove(&row->render[rx], &row->render[rx + 1], end - rx);
+  if (k < row->ntabs) row->render[end] = ' ';
+  row->render[row->rsize] = '\0';
+  for (int j = k; j < row->ntabs; j++) row->tabs[j].cx--;
+  return 1;
+}
+
+// Rebuilds render after an edit. hl is rebuilt when the row is next drawn.
+void editorUpdateRow(erow *row) {
+  editorRenderRow(row);
+  editorRowChanged(row);
+}
+
+// Builds render for rows that were loaded lazily, and moves the render
+// window of long rows to the part of the row on screen.
+void editorPrepareRow(erow *row) {
+  if (row->render == NULL)
+    editorRenderRow(row);
+  else if (row->rwindow && !editorRenderWindowCovers(row))
+    editorRenderWindow(row);
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+  erow *row = editorRowBufferInsert(at);
 
-  E.row[at].idx = at;
+  row->size = len;
+  row->capacity = len + 1;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  row->gap = -1;
+  row->rsize = 0;
+  row->render = NULL;
+  row->roff = 0;
+  row->rwindow = 0;
+  row->tabs = NULL;
+  row->ntabs = 0;
+  row->snapshot = 0;
+  row->hl = NULL;
+  row->hl_in = -1;
+  row->hl_open_comment = 0;
+  editorRenderRow(row);
+  editorInvalidateSyntax(at);
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
-
-  E.numrows++;
   E.dirty++;
 }
 
+// Adds a row whose text stays in the file mapping until it is edited.
+// render and hl are built on first use by editorPrepareRow.
+void editorAppendMappedRow(char *s, size_t len) {
+  erow *row = editorRowBufferInsert(E.numrows);
+  row->size = len;
+  row->capacity = 0;
+  row->chars = s;
+  row->gap = -1;
+  row->rsize = 0;
+  row->render = NULL;
+  row->roff = 0;
+  row->rwindow = 0;
+  row->tabs = NULL;
+  row->ntabs = 0;
+  row->snapshot = 0;
+  row->hl = NULL;
+  row->hl_in = -1;
+  row->hl_open_comment = 0;
+}
+
+// Whether a running save still has to write the text of row.
+int editorRowShared(erow *row) {
+  return E.snapshot && row->snapshot == E.snapshot;
+}
+
+// Frees the text of row, or leaves it to the save that is writing it.
+void editorRowFreeChars(erow *row) {
+  if (row->capacity == 0) return;
+  if (editorRowShared(row))
+    editorSaveRetire(row->chars);
+  else
+    free(row->chars);
+}
+
 void editorFreeRow(erow *row) {
   free(row->render);
-  free(row->chars);
+  free(row->tabs);
+  editorRowFreeChars(row);
   free(row->hl);
 }
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
+  editorFreeRow(editorRow(at));
+  editorRowBufferDelete(at);
+  editorInvalidateSyntax(at);
   E.dirty++;
 }
 
+// Grows chars geometrically so typing into a row reallocs O(log n) times.
+// A row still borrowed from the file mapping or a running save gets its own
+// copy first.
+void editorRowReserve(erow *row, int size) {
+  editorRowChars(row);
+  int shared = editorRowShared(row);
+  if (size <= row->capacity && !shared) return;
+  int capacity = row->capacity;
+  if (capacity < size) capacity = capacity * 2 < size ? size : capacity * 2;
+  if (row->capacity == 0 || shared) {
+    char *chars = malloc(capacity);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    editorRowFreeChars(row);
+    row->chars = chars;
+    row->snapshot = 0;
+  } else {
+    row->chars = realloc(row->chars, capacity);
+  }
+  row->capacity = capacity;
+}
+
+// Gives every row still borrowed from the file mapping its own copy and
+// drops the mapping, before the file is overwritten in place.
+void editorUnmapRows() {
+  if (!E.map) return;
+  for (int j = 0; j < E.numrows; j++) {
+    erow *row = editorRow(j);
+    if (row->capacity == 0) editorRowReserve(row, row->size + 1);
+  }
+  munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = 0;
+}
+
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
+  if (row->rwindow && c != '\t') {
+    editorRowMoveGap(row, at);
+    row->chars[row->gap++] = c;
+    row->size++;
+    editorRowShiftTabs(row, at, 1);
+    row->roff = -1;
+    editorRowChanged(row);
+    E.dirty++;
+    return;
+  }
+  editorRowReserve(row, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
-  editorUpdateRow(row);
+  if (c != '\t' && row->render && editorRenderInsertChar(row, at))
+    editorRowChanged(row);
+  else
+    editorUpdateRow(row);
   E.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+  editorRowReserve(row, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
@@ -107,10 +423,82 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
   E.dirty++;
 }
 
+void editorRowInsertString(erow *row, int at, char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowReserve(row, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowDelChars(erow *row, int at, int len) {
+  if (at < 0 || at >= row->size || len <= 0) return;
+  if (len > row->size - at) len = row->size - at;
+  editorRowReserve(row, row->size + 1);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size) return;
+  if (row->rwindow && editorRowCharAt(row, at) != '\t') {
+    editorRowMoveGap(row, at);
+    row->size--;
+    editorRowShiftTabs(row, at, -1);
+    row->roff = -1;
+    editorRowChanged(row);
+    E.dirty++;
+    return;
+  }
+  editorRowReserve(row, row->size + 1);
+  int tab = row->chars[at] == '\t';
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
+  if (!tab && row->render && editorRenderDelChar(row, at))
+    editorRowChanged(row);
+  else
+    editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowTruncate(erow *row, int size) {
+  if (size < 0 || size >= row->size) return;
+  editorRowReserve(row, row->size + 1);
+  row->size = size;
+  row->chars[size] = '\0';
   editorUpdateRow(row);
   E.dirty++;
 }
+
+// Exchanges the text of a row with a heap buffer of len bytes plus a NUL.
+// The row takes the buffer and *text, *len receive its old text. Render is
+// rebuilt when the row is next drawn, so a bulk edit renders each row at
+// most once.
+void editorRowSwapText(erow *row, char **text, int *len) {
+  char *old = editorRowChars(row);
+  if (row->capacity == 0 || editorRowShared(row)) {
+    old = malloc(row->size + 1);
+    memcpy(old, row->chars, row->size);
+    old[row->size] = '\0';
+    editorRowFreeChars(row);
+    row->snapshot = 0;
+  }
+  int oldlen = row->size;
+  row->chars = *text;
+  row->size = *len;
+  row->capacity = *len + 1;
+  row->gap = -1;
+  free(row->render);
+  row->render = NULL;
+  row->rsize = 0;
+  row->roff = 0;
+  row->rwindow = 0;
+  editorRowChanged(row);
+  *text = old;
+  *len = oldlen;
+  E.dirty++;
+}
@@ -0,0 +1,321 @@
+#include "save.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "highlight.h"
+#include "history.h"
+#include "input.h"
+#include "output.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+#include "swap.h"
+#include "terminal.h"
+
+/*** save ***/
+// A save takes a snapshot of the rows and writes it on a worker thread
+// while editing goes on. The snapshot only copies the text pointer and size
+// of each row and tags the row with the snapshot id. A tagged row that is
+// edited, replaced or deleted before the save is done gets a fresh copy of
+// its text, and its old text is freed once the save no longer needs it.
+// Rows still in the file mapping are never written to, so they are shared
+// as they are, and rows that follow each other there go into the snapshot
+// as one run of the mapping, newlines included. The snapshot of a file
+// that was opened and edited here and there takes a few runs however many
+// rows it has.
+//
+// The worker streams the snapshot into a temporary file, SAVE_IOV_ROWS runs
+// per writev, so saving takes no more memory however large the file is. It
+// hashes the content on the way, syncs the file and renames it over the
+// target, so a failed save leaves the old file intact. Progress and the end
+// of the save reach the main thread through a pipe.
+//
+// A rename would split a file with other hard links from them, so such a
+// file is overwritten in place from the finished temporary file instead.
+// Its rows are copied out of the file mapping first, and the temporary
+// file is kept if the copy fails.
+#define SAVE_IOV_ROWS 512
+#define SAVE_PROGRESS_BYTES (64 << 20)
+
+static struct {
+  pthread_t thread;
+  int threaded;
+  int running;
+  int notify[2];
+  int id;  // Snapshot id the rows of this save are tagged with
+  struct iovec *runs;
+  int nruns;
+  int runcap;
+  char *map;  // E.map when the snapshot was taken
+  size_t maplen;
+  char *path;  // Target, with symlinks resolved
+  char *tmp;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  int inplace;  // Overwrite the target instead of renaming over it
+  int kept;     // The temporary file holds the content of a failed save
+  uint64_t size;
+  uint64_t hash;
+  atomic_ullong written;
+  atomic_int done;
+  int ok;
+  int err;
+  int dirty;    // E.dirty when the snapshot was taken
+  int undo_at;  // Undo log position of the snapshot
+  char **retired;
+  int nretired;
+  int retiredcap;
+} sv = {.notify = {-1, -1}, .ok = 1};
+
+// Takes the text of a snapshot row that is about to be changed or freed.
+void editorSaveRetire(char *chars) {
+  if (sv.nretired == sv.retiredcap) {
+    sv.retiredcap = sv.retiredcap ? sv.retiredcap * 2 : 64;
+    sv.retired = realloc(sv.retired, sizeof(char *) * sv.retiredcap);
+  }
+  sv.retired[sv.nretired++] = chars;
+}
+
+// Writes all of iov, continuing after short writes.
+int saveWritev(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+// Returns whether a run of the snapshot holds its own newline, which only
+// runs of the file mapping do.
+int saveRunHasNewline(struct iovec *run) {
+  char *p = run->iov_base;
+  return p >= sv.map && p < sv.map + sv.maplen && run->iov_len > 0 &&
+         p[run->iov_len - 1] == '\n';
+}
+
+// Adds a row to the snapshot.
+void saveAddRow(erow *row) {
+  char *chars = editorRowChars(row);
+  size_t len = row->size;
+  int mapped = row->capacity == 0 && chars + len < sv.map + sv.maplen &&
+               chars[len] == '\n';
+  if (mapped) len++;
+  struct iovec *last = sv.nruns ? &sv.runs[sv.nruns - 1] : NULL;
+  if (mapped && last && saveRunHasNewline(last) &&
+      (char *)last->iov_base + last->iov_len == chars) {
+    last->iov_len += len;
+    return;
+  }
+  if (sv.nruns == sv.runcap) {
+    sv.runcap = sv.runcap ? sv.runcap * 2 : 64;
+    sv.runs = realloc(sv.runs, sizeof(struct iovec) * sv.runcap);
+  }
+  sv.runs[sv.nruns++] = (struct iovec){chars, len};
+}
+
+// Writes the snapshot to fd, a newline after each row.
+int saveWriteRows(int fd) {
+  struct contentHash c;
+  editorHashInit(&c, sv.size);
+  struct iovec iov[SAVE_IOV_ROWS * 2];
+  uint64_t written = 0, reported = 0;
+  int n = 0;
+  for (int j = 0; j < sv.nruns; j++) {
+    struct iovec *run = &sv.runs[j];
+    editorHashUpdate(&c, run->iov_base, run->iov_len);
+    iov[n++] = *run;
+    written += run->iov_len;
+    if (!saveRunHasNewline(run)) {
+      editorHashUpdate(&c, "\n", 1);
+      iov[n++] = (struct iovec){"\n", 1};
+      written++;
+    }
+    if (n >= SAVE_IOV_ROWS * 2 - 1 || j == sv.nruns - 1) {
+      if (saveWritev(fd, iov, n) == -1) return -1;
+      n = 0;
+      atomic_store(&sv.written, written);
+      if (written - reported >= SAVE_PROGRESS_BYTES) {
+        write(sv.notify[1], "", 1);
+        reported = written;
+      }
+    }
+  }
+  sv.hash = editorHashFinal(&c);
+  return 0;
+}
+
+// Copies the temporary file from over the target, keeping its inode.
+int saveCopyInPlace(int from) {
+  int fd = open(sv.path, O_WRONLY);
+  if (fd == -1) return -1;
+  static char buf[1 << 16];
+  off_t at = 0;
+  ssize_t n;
+  while ((n = pread(from, buf, sizeof(buf), at)) > 0) {
+    struct iovec iov = {buf, n};
+    if (saveWritev(fd, &iov, 1) == -1) break;
+    at += n;
+  }
+  int ok = n == 0 && ftruncate(fd, at) == 0 && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  return ok ? 0 : -1;
+}
+
+void *saveWorkerRun(void *arg) {
+  (void)arg;
+  // A stale temporary file may be a link to somewhere else, so it is
+  // removed and the new one is created exclusively.
+  unlink(sv.tmp);
+  int fd = open(sv.tmp, O_RDWR | O_CREAT | O_EXCL, sv.mode);
+  int ok = fd != -1;
+  if (ok) {
+    // Only root can hand a file to another owner; others keep their own.
+    ok = (fchown(fd, sv.uid, sv.gid) == 0 || errno == EPERM) &&
+         fchmod(fd, sv.mode) == 0 && saveWriteRows(fd) == 0 &&
+         fsync(fd) == 0;
+    if (ok && sv.inplace) {
+      ok = saveCopyInPlace(fd) == 0;
+      sv.kept = !ok;
+    }
+    ok = close(fd) == 0 && ok;
+    if (ok && sv.inplace)
+      unlink(sv.tmp);
+    else
+      ok = ok && rename(sv.tmp, sv.path) == 0;
+  }
+  sv.err = errno;
+  if (fd != -1 && !ok && !sv.kept) unlink(sv.tmp);
+  sv.ok = ok;
+  atomic_store(&sv.done, 1);
+  write(sv.notify[1], "", 1);
+  return NULL;
+}
+
+// Ends the save on the main thread, once the worker is done with the
+// snapshot.
+void saveFinish() {
+  if (sv.threaded) pthread_join(sv.thread, NULL);
+  sv.running = 0;
+  E.snapshot = 0;
+  for (int i = 0; i < sv.nretired; i++) free(sv.retired[i]);
+  sv.nretired = 0;
+  free(sv.runs);
+  sv.runs = NULL;
+  sv.nruns = sv.runcap = 0;
+  free(sv.path);
+  if (!sv.ok) {
+    editorSwapUnmark();
+    if (sv.kept)
+      editorSetStatusMessage("Can't save! I/O error: %s, content is in %s",
+                             strerror(sv.err), sv.tmp);
+    else
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(sv.err));
+    free(sv.tmp);
+    return;
+  }
+  free(sv.tmp);
+  // Changes made while saving stay unsaved.
+  editorSaveUndoFile(E.filename, sv.size, sv.hash, sv.undo_at);
+  editorSwapSaved(sv.size, sv.hash);
+  E.dirty -= sv.dirty;
+  E.filesize = sv.size;
+  editorSetStatusMessage("%llu bytes written to disk",
+                         (unsigned long long)sv.size);
+}
+
+void saveProgress(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  if (!sv.running) return;
+  if (atomic_load(&sv.done)) {
+    saveFinish();
+    return;
+  }
+  uint64_t written = atomic_load(&sv.written);
+  editorSetStatusMessage("Saving... %d%%",
+                         sv.size ? (int)(written * 100 / sv.size) : 100);
+}
+
+// Blocks until a running save is done. Returns 0 if it failed.
+int editorSaveWait() {
+  if (sv.running) saveFinish();
+  return sv.ok;
+}
+
+void editorSave() {
+  if (sv.running) {
+    editorSetStatusMessage("Save in progress");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  if (sv.notify[0] == -1) {
+    if (pipe(sv.notify) == -1) die("pipe");
+    fcntl(sv.notify[0], F_SETFL, O_NONBLOCK);
+    editorWatchFd(sv.notify[0], saveProgress);
+  }
+
+  sv.path = realpath(E.filename, NULL);
+  if (!sv.path) sv.path = strdup(E.filename);
+  sv.tmp = editorSideFilePath(sv.path, "save");
+  struct stat st;
+  int exists = stat(sv.path, &st) == 0;
+  sv.mode = exists ? st.st_mode & 07777 : 0644;
+  sv.uid = exists ? st.st_uid : (uid_t)-1;
+  sv.gid = exists ? st.st_gid : (gid_t)-1;
+  sv.inplace = exists && st.st_nlink > 1;
+  sv.kept = 0;
+  if (sv.inplace) editorUnmapRows();
+
+  sv.id++;
+  E.snapshot = sv.id;
+  sv.map = E.map;
+  sv.maplen = E.maplen;
+  sv.size = 0;
+  for (int j = 0; j < E.numrows; j++) {
+    erow *row = editorRow(j);
+    saveAddRow(row);
+    row->snapshot = sv.id;
+    sv.size += row->size + 1;
+  }
+  sv.dirty = E.dirty;
+  sv.undo_at = editorUndoMark();
+  editorSwapMark();
+
+  atomic_store(&sv.written, 0);
+  atomic_store(&sv.done, 0);
+  sv.running = 1;
+  sv.threaded = !pthread_create(&sv.thread, NULL, saveWorkerRun, NULL);
+  // Without a thread the file is written right here.
+  if (!sv.threaded) saveWorkerRun(NULL);
+  editorSetStatusMessage("Saving...");
+}
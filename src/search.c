@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include "search.h"
+
+#include <limits.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "definitions.h"
+#include "pattern.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+
+// Backward searches scan this many bytes at a time from the end, so finding
+// the previous match does not read everything before it.
+#define SEARCH_CHUNK (1 << 20)
+
+/*** substring search ***/
+#ifdef __SSE2__
+// Compares the first and last byte of the needle against 16 candidate
+// positions at once and only runs memcmp where both agree.
+const char *searchMemmem(const char *hay, size_t hlen, const char *needle,
+                         size_t nlen) {
+  if (nlen == 0) return hay;
+  if (hlen < nlen) return NULL;
+  if (nlen == 1) return memchr(hay, needle[0], hlen);
+
+  size_t end = hlen - nlen + 1;
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+  size_t i = 0;
+  for (; i + 16 <= end; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(hay + i + bit + 1, needle + 1, nlen - 2))
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  for (; i < end; i++) {
+    if (hay[i] == needle[0] && hay[i + nlen - 1] == needle[nlen - 1] &&
+        !memcmp(hay + i + 1, needle + 1, nlen - 2))
+      return hay + i;
+  }
+  return NULL;
+}
+#else
+const char *searchMemmem(const char *hay, size_t hlen, const char *needle,
+                         size_t nlen) {
+  return memmem(hay, hlen, needle, nlen);
+}
+#endif
+
+// Finds the last match in hay, scanning fixed-size chunks from the end.
+const char *searchMemmemLast(const char *hay, size_t hlen, const char *needle,
+                             size_t nlen) {
+  size_t end = hlen;
+  while (end >= nlen) {
+    size_t start = end > SEARCH_CHUNK ? end - SEARCH_CHUNK : 0;
+    const char *p = hay + start;
+    const char *last = NULL;
+    const char *match;
+    while ((match = searchMemmem(p, hay + end - p, needle, nlen))) {
+      last = match;
+      p = match + 1;
+    }
+    if (last) return last;
+    if (start == 0) break;
+    // Overlap the chunks so a match across the boundary is still seen.
+    end = start + nlen - 1;
+  }
+  return NULL;
+}
+
+/*** row spans ***/
+// Rows loaded from the file mapping sit back to back in memory, separated
+// only by their line endings. A run of them is searched as one buffer.
+int editorRowsAdjacent(erow *row, erow *next) {
+  if (row->capacity != 0 || next->capacity != 0) return 0;
+  char *end = row->chars + row->size;
+  return next->chars > end && next->chars - end <= 2;
+}
+
+// Returns one past the last row of the span starting at `at`. Spans are cut
+// at about SEARCH_CHUNK bytes so a match near the start is found without
+// walking every row after it.
+int editorSpanEnd(int at, int limit) {
+  erow *first = editorRow(at);
+  int end = at + 1;
+  while (end < limit) {
+    erow *row = editorRow(end);
+    if (!editorRowsAdjacent(editorRow(end - 1), row) ||
+        row->chars - first->chars > SEARCH_CHUNK)
+      break;
+    end++;
+  }
+  return end;
+}
+
+// Returns the first row of the span ending at `at`.
+int editorSpanStart(int at, int limit) {
+  erow *last = editorRow(at);
+  int start = at;
+  while (start > limit) {
+    erow *row = editorRow(start - 1);
+    if (!editorRowsAdjacent(row, editorRow(start)) ||
+        last->chars - row->chars > SEARCH_CHUNK)
+      break;
+    start--;
+  }
+  return start;
+}
+
+// Maps a pointer into a span back to the row that contains it.
+int editorSpanRow(int from, int to, const char *p) {
+  while (to - from > 1) {
+    int mid = from + (to - from) / 2;
+    if (editorRow(mid)->chars <= p)
+      from = mid;
+    else
+      to = mid;
+  }
+  return from;
+}
+
+/*** search ***/
+// Finds the first match starting at or after (row, col) and before row
+// endrow. The prompt never lets a line break into the needle, so a match
+// found in a span always lies within one row.
+int editorSearchForward(const char *needle, int nlen, int row, int col,
+                        int endrow, int *mrow, int *mcol) {
+  for (int at = row; at < endrow;) {
+    int end = editorSpanEnd(at, endrow);
+    erow *first = editorRow(at);
+    erow *last = editorRow(end - 1);
+    char *start = editorRowChars(first);
+    if (at == row) start += col < first->size ? col : first->size;
+    char *stop = editorRowChars(last) + last->size;
+    const char *match = searchMemmem(start, stop - start, needle, nlen);
+    if (match) {
+      *mrow = end - at > 1 ? editorSpanRow(at, end, match) : at;
+      *mcol = match - editorRow(*mrow)->chars;
+      return 1;
+    }
+    at = end;
+  }
+  return 0;
+}
+
+// Finds the last match starting before (row, col) and at or after
+// (endrow, endcol).
+int editorSearchBackward(const char *needle, int nlen, int row, int col,
+                         int endrow, int endcol, int *mrow, int *mcol) {
+  for (int at = row; at >= endrow;) {
+    int start = editorSpanStart(at, endrow);
+    erow *first = editorRow(start);
+    erow *last = editorRow(at);
+    char *begin = editorRowChars(first);
+    if (start == endrow) begin += endcol < first->size ? endcol : first->size;
+    char *stop = editorRowChars(last) + last->size;
+    if (at == row && (long)col - 1 + nlen < last->size)
+      stop = last->chars + (col > 0 ? col - 1 + nlen : 0);
+    const char *match = NULL;
+    if (stop > begin)
+      match = searchMemmemLast(begin, stop - begin, needle, nlen);
+    if (match) {
+      *mrow = at - start > 0 ? editorSpanRow(start, at + 1, match) : at;
+      *mcol = match - editorRow(*mrow)->chars;
+      return 1;
+    }
+    at = start - 1;
+  }
+  return 0;
+}
+
+/*** pattern search ***/
+// Regular expressions are matched one row at a time, since `^` and `$`
+// depend on where rows begin and end.
+int editorPatternForward(struct pattern *p, int row, int col, int endrow,
+                         int *mrow, int *mcol, int *mlen) {
+  for (int at = row; at < endrow; at++) {
+    erow *r = editorRow(at);
+    int start, end;
+    if (patternMatch(p, editorRowChars(r), r->size, at == row ? col : 0,
+                     &start, &end)) {
+      *mrow = at;
+      *mcol = start;
+      *mlen = end - start;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int editorPatternBackward(struct pattern *p, int row, int col, int endrow,
+                          int endcol, int *mrow, int *mcol, int *mlen) {
+  for (int at = row; at >= endrow; at--) {
+    erow *r = editorRow(at);
+    int start, end;
+    if (patternMatchLast(p, editorRowChars(r), r->size,
+                         at == endrow ? endcol : 0, at == row ? col : INT_MAX,
+                         &start, &end)) {
+      *mrow = at;
+      *mcol = start;
+      *mlen = end - start;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,242 @@
+#include "substitute.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "history.h"
+#include "input.h"
+#include "output.h"
+#include "pattern.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+
+/*** substitute ***/
+// :[range]s/pattern/replacement/[g] builds the new text of each row in one
+// pass. Rows are independent, so a large range is split across threads
+// that only build new texts. The main thread then swaps them in, and the
+// old texts become a single undo entry.
+#define MAX_SUBSTITUTE_WORKERS 8
+#define MIN_ROWS_PER_WORKER 4096
+
+struct substituteJob {
+  pthread_t thread;
+  int threaded;
+  struct pattern *pattern;
+  const char *rep;
+  int global;
+  int from;
+  int to;
+  struct rowText *rows;  // New texts of the rows that changed
+  int nrows;
+  int cap;
+  long count;
+};
+
+struct rowBuild {
+  char *b;
+  int len;
+  int cap;
+  const char *text;
+  int last;  // End of the text already copied
+  const char *rep;
+  long count;
+};
+
+void rowBuildAppend(struct rowBuild *rb, const char *s, int len) {
+  if (rb->len + len > rb->cap) {
+    int cap = rb->cap ? rb->cap * 2 : 64;
+    while (cap < rb->len + len) cap *= 2;
+    rb->b = realloc(rb->b, cap);
+    rb->cap = cap;
+  }
+  memcpy(&rb->b[rb->len], s, len);
+  rb->len += len;
+}
+
+// Copies the text up to a match, then the replacement: & stands for the
+// match, \t for a tab and a backslash quotes the next character.
+void substituteMatch(void *arg, int start, int end) {
+  struct rowBuild *rb = arg;
+  rowBuildAppend(rb, &rb->text[rb->last], start - rb->last);
+  for (const char *r = rb->rep; *r; r++) {
+    if (*r == '&') {
+      rowBuildAppend(rb, &rb->text[start], end - start);
+    } else if (*r == '\\' && r[1]) {
+      r++;
+      rowBuildAppend(rb, *r == 't' ? "\t" : r, 1);
+    } else {
+      rowBuildAppend(rb, r, 1);
+    }
+  }
+  rb->last = end;
+  rb->count++;
+}
+
+void *substituteRun(void *arg) {
+  struct substituteJob *job = arg;
+  for (int at = job->from; at < job->to; at++) {
+    erow *row = editorRow(at);
+    char *text = editorRowChars(row);
+    struct rowBuild rb = {NULL, 0, 0, text, 0, job->rep, 0};
+    int start, end;
+    if (job->global)
+      patternMatchAll(job->pattern, text, row->size, substituteMatch, &rb);
+    else if (patternMatch(job->pattern, text, row->size, 0, &start, &end))
+      substituteMatch(&rb, start, end);
+    if (!rb.count) continue;
+    rowBuildAppend(&rb, &text[rb.last], row->size - rb.last);
+    rowBuildAppend(&rb, "", 1);
+    if (job->nrows == job->cap) {
+      job->cap = job->cap ? job->cap * 2 : 64;
+      job->rows = realloc(job->rows, sizeof(struct rowText) * job->cap);
+    }
+    job->rows[job->nrows++] = (struct rowText){at, rb.b, rb.len - 1};
+    job->count += rb.count;
+  }
+  return NULL;
+}
+
+/*** command parsing ***/
+// Parses a line number, . or $ into a 0-based row.
+int parseAddress(char **p, int *row) {
+  if (isdigit(**p)) {
+    *row = strtol(*p, p, 10) - 1;
+  } else if (**p == '.') {
+    *row = E.cy;
+    (*p)++;
+  } else if (**p == '$') {
+    *row = E.numrows - 1;
+    (*p)++;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Parses %, a or a,b. Without a range only the cursor row is used.
+void parseRange(char **p, int *from, int *to) {
+  *from = *to = E.cy;
+  if (**p == '%') {
+    *from = 0;
+    *to = E.numrows - 1;
+    (*p)++;
+  } else if (parseAddress(p, from)) {
+    *to = *from;
+    if (**p == ',') {
+      (*p)++;
+      parseAddress(p, to);
+    }
+  }
+  if (*from > *to) {
+    int t = *from;
+    *from = *to;
+    *to = t;
+  }
+  if (*from < 0) *from = 0;
+  if (*to >= E.numrows) *to = E.numrows - 1;
+}
+
+// Returns the text up to the next unescaped delimiter, with escaped
+// delimiters unquoted, and moves *p past the delimiter.
+char *parsePart(char **p, char delim) {
+  char *part = malloc(strlen(*p) + 1);
+  int len = 0;
+  char *s = *p;
+  while (*s && *s != delim) {
+    if (*s == '\\' && s[1] == delim) s++;
+    else if (*s == '\\' && s[1]) part[len++] = *s++;
+    part[len++] = *s++;
+  }
+  part[len] = '\0';
+  *p = *s ? s + 1 : s;
+  return part;
+}
+
+// Runs a :s command. Returns 0 if the command is not a substitution.
+int editorSubstitute(char *command) {
+  char *p = command;
+  int from, to;
+  parseRange(&p, &from, &to);
+  if (*p != 's') return 0;
+  char delim = *++p;
+  if (!delim || isalnum(delim) || isspace(delim) || delim == '\\') return 0;
+  p++;
+  char *pat = parsePart(&p, delim);
+  char *rep = parsePart(&p, delim);
+  int global = 0;
+  for (; *p; p++) {
+    if (*p != 'g') {
+      editorSetStatusMessage("Unknown flag: %c", *p);
+      goto out;
+    }
+    global = 1;
+  }
+  if (from > to || editorReadOnly()) goto out;
+
+  int n = sysconf(_SC_NPROCESSORS_ONLN);
+  int rows = to - from + 1;
+  if (n > MAX_SUBSTITUTE_WORKERS) n = MAX_SUBSTITUTE_WORKERS;
+  if (n > rows / MIN_ROWS_PER_WORKER) n = rows / MIN_ROWS_PER_WORKER;
+  if (n < 1) n = 1;
+  struct substituteJob jobs[MAX_SUBSTITUTE_WORKERS];
+  memset(jobs, 0, sizeof(jobs));
+  for (int i = 0; i < n; i++) {
+    // Each thread matches with its own copy, since the DFA cache is
+    // built while matching.
+    if (!(jobs[i].pattern = patternCompile(pat))) {
+      editorSetStatusMessage("Invalid pattern: %s", pat);
+      for (int j = 0; j < i; j++) patternFree(jobs[j].pattern);
+      goto out;
+    }
+    jobs[i].rep = rep;
+    jobs[i].global = global;
+    jobs[i].from = from + (long)rows * i / n;
+    jobs[i].to = from + (long)rows * (i + 1) / n;
+  }
+  for (int i = 1; i < n; i++)
+    jobs[i].threaded =
+        !pthread_create(&jobs[i].thread, NULL, substituteRun, &jobs[i]);
+  substituteRun(&jobs[0]);
+  for (int i = 1; i < n; i++) {
+    if (jobs[i].threaded)
+      pthread_join(jobs[i].thread, NULL);
+    else
+      substituteRun(&jobs[i]);
+  }
+
+  int nrows = 0;
+  long count = 0;
+  for (int i = 0; i < n; i++) {
+    nrows += jobs[i].nrows;
+    count += jobs[i].count;
+  }
+  struct rowText *undo = malloc(sizeof(struct rowText) * (nrows ? nrows : 1));
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < jobs[i].nrows; j++) {
+      struct rowText *r = &jobs[i].rows[j];
+      editorRowSwapText(editorRow(r->at), &r->text, &r->len);
+      undo[k++] = *r;
+    }
+    free(jobs[i].rows);
+    patternFree(jobs[i].pattern);
+  }
+  if (nrows == 0) {
+    free(undo);
+    editorSetStatusMessage("Pattern not found: %s", pat);
+    goto out;
+  }
+  addUndoRows(E.cy, E.cx, undo, nrows);
+  E.cy = undo[nrows - 1].at;
+  E.cx = COL_OFFSET;
+  editorSetStatusMessage("%ld substitutions on %d lines", count, nrows);
+
+out:
+  free(pat);
+  free(rep);
+  return 1;
+}
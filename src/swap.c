@@ -0,0 +1,409 @@
+#include "swap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "history.h"
+#include "input.h"
+#include "output.h"
+#include "rowBuffer.h"
+#include "rowOperations.h"
+#include "terminal.h"
+
+/*** swap file ***/
+// Unsaved changes are logged to .<name>.avi-swap next to the file, so they
+// can be recovered after a crash. Every change to the buffer is appended to
+// a pending buffer as a small record. A writer thread takes the pending
+// records every SWAP_WRITE_MS and appends them to the file. What it wrote
+// is synced SWAP_SYNC_MS after the last sync as a checkpoint. Editing only
+// takes the lock to append a record.
+//
+// The header holds the size and hash of the file the changes apply to,
+// and is rewritten when the file is saved. A save writes a snapshot taken
+// earlier, so the records logged since the snapshot are kept aside until
+// the save is done and then start the new file.
+//
+// The session logging to a swap file holds an exclusive lock on it, so a
+// second session on the same file leaves it alone. A swap file that can be
+// locked on open was left by a session that ended without saving. If its
+// base still matches the file, the user is asked whether to replay it.
+#define SWAP_MAGIC "AVISWAP1"
+#define SWAP_WRITE_MS 200
+#define SWAP_SYNC_MS 2000
+
+struct swapHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t hash;
+};
+
+struct swapRecord {
+  int32_t kind;
+  int32_t y;
+  int32_t x;
+  int32_t len;  // Bytes of text that follow
+};
+
+static struct {
+  char *path;
+  int fd;
+  pthread_t thread;
+  int running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct abuf pending;  // Records not yet taken by the writer
+  struct abuf spare;    // The writer's buffer, handed back empty
+  int last;             // Offset of the last pending record, or -1
+  int reset;            // Start the file over before the pending records
+  int marking;          // A save is running, see editorSwapMark
+  struct abuf marked;   // Records since the save snapshot
+  char *base;           // File to hash for the header, or NULL if known
+  struct swapHeader header;
+  int stop;
+  int recovering;
+} sw = {.fd = -1,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .last = -1};
+
+long swapNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void *swapWriterRun(void *arg) {
+  (void)arg;
+  long synced = swapNowMs();
+  int unsynced = 0;
+  pthread_mutex_lock(&sw.lock);
+  while (1) {
+    while (!sw.stop && sw.pending.len == 0 && !sw.reset) {
+      if (!unsynced) {
+        pthread_cond_wait(&sw.cond, &sw.lock);
+        continue;
+      }
+      // Records already written are synced once the checkpoint is due,
+      // even if no more follow.
+      long wait = synced + SWAP_SYNC_MS - swapNowMs();
+      if (wait <= 0) break;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += wait / 1000;
+      ts.tv_nsec += wait % 1000 * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&sw.cond, &sw.lock, &ts);
+    }
+    if (sw.stop) break;
+    if (sw.pending.len == 0 && !sw.reset) {
+      pthread_mutex_unlock(&sw.lock);
+      fdatasync(sw.fd);
+      synced = swapNowMs();
+      unsynced = 0;
+      pthread_mutex_lock(&sw.lock);
+      continue;
+    }
+    // Let a burst of typing collect into one write.
+    pthread_mutex_unlock(&sw.lock);
+    usleep(SWAP_WRITE_MS * 1000);
+    pthread_mutex_lock(&sw.lock);
+
+    struct abuf batch = sw.pending;
+    sw.pending = sw.spare;
+    sw.last = -1;
+    int reset = sw.reset;
+    sw.reset = 0;
+    char *base = sw.base;
+    sw.base = NULL;
+    struct swapHeader header = sw.header;
+    pthread_mutex_unlock(&sw.lock);
+
+    if (reset) {
+      if (base) editorHashFile(base, &header.size, &header.hash);
+      free(base);
+      if (ftruncate(sw.fd, 0) == 0)
+        write(sw.fd, &header, sizeof(header));
+    }
+    write(sw.fd, batch.b, batch.len);
+    unsynced = 1;
+    if (swapNowMs() - synced >= SWAP_SYNC_MS) {
+      fdatasync(sw.fd);
+      synced = swapNowMs();
+      unsynced = 0;
+    }
+
+    pthread_mutex_lock(&sw.lock);
+    batch.len = 0;
+    sw.spare = batch;
+  }
+  pthread_mutex_unlock(&sw.lock);
+  return NULL;
+}
+
+void editorSwapChange(int kind, int y, int x, const char *s, int len) {
+  if (!sw.running || sw.recovering) return;
+  pthread_mutex_lock(&sw.lock);
+  // Typing on one line extends the last insert instead of adding a record.
+  struct swapRecord *last = sw.last >= 0 && !sw.marking
+                                ? (struct swapRecord *)&sw.pending.b[sw.last]
+                                : NULL;
+  if (kind == SWAP_INSERT && last && last->kind == SWAP_INSERT &&
+      last->y == y && last->x + last->len == x && !memchr(s, '\n', len) &&
+      !memchr(&sw.pending.b[sw.last + sizeof(*last)], '\n', last->len)) {
+    last->len += len;
+    abAppend(&sw.pending, s, len);
+  } else {
+    struct swapRecord r = {kind, y, x, len};
+    sw.last = sw.pending.len;
+    abAppend(&sw.pending, (const char *)&r, sizeof(r));
+    abAppend(&sw.pending, s, len);
+  }
+  if (sw.marking) {
+    struct swapRecord r = {kind, y, x, len};
+    abAppend(&sw.marked, (const char *)&r, sizeof(r));
+    abAppend(&sw.marked, s, len);
+  }
+  pthread_cond_signal(&sw.cond);
+  pthread_mutex_unlock(&sw.lock);
+}
+
+// Marks where a save snapshot was taken. Records that follow are also kept
+// aside, as the start of the swap file once the save is done.
+void editorSwapMark() {
+  if (!sw.running) return;
+  pthread_mutex_lock(&sw.lock);
+  sw.marking = 1;
+  sw.marked.len = 0;
+  pthread_mutex_unlock(&sw.lock);
+}
+
+void editorSwapUnmark() {
+  pthread_mutex_lock(&sw.lock);
+  sw.marking = 0;
+  sw.marked.len = 0;
+  pthread_mutex_unlock(&sw.lock);
+}
+
+// The file on disk now holds the snapshot of the last editorSwapMark, so
+// only the changes made since are kept.
+void editorSwapSaved(uint64_t size, uint64_t hash) {
+  if (!sw.running) return;
+  pthread_mutex_lock(&sw.lock);
+  sw.pending.len = 0;
+  abAppend(&sw.pending, sw.marked.b, sw.marked.len);
+  sw.marked.len = 0;
+  sw.marking = 0;
+  sw.last = -1;
+  sw.reset = 1;
+  free(sw.base);
+  sw.base = NULL;
+  sw.header.size = size;
+  sw.header.hash = hash;
+  pthread_cond_signal(&sw.cond);
+  pthread_mutex_unlock(&sw.lock);
+}
+
+/*** recovery ***/
+// Applies one record to the buffer through the undo log, so the recovered
+// changes can be undone. Returns 0 if it does not fit the buffer.
+int swapApply(struct swapRecord *r, char *text, struct abuf *rows) {
+  if (r->y < 0 || r->y > E.numrows || r->len < 0) return 0;
+  erow *row = r->y < E.numrows ? editorRow(r->y) : NULL;
+  if (r->kind == SWAP_INSERT || r->kind == SWAP_DELETE) {
+    if (r->x < COL_OFFSET || r->x > COL_OFFSET + (row ? row->size : 0))
+      return 0;
+  }
+  switch (r->kind) {
+    case SWAP_INSERT:
+      E.cy = r->y;
+      E.cx = r->x;
+      editorInsertText(text, r->len);
+      break;
+    case SWAP_DELETE:
+      if (!row) return 0;
+      addUndoDelete(r->y, r->x, text, r->len);
+      editorDeleteText(r->y, r->x, text, r->len);
+      break;
+    case SWAP_INSERT_ROW:
+      addUndoInsertRow(r->y);
+      editorInsertRow(r->y, "", 0);
+      E.cy = r->y;
+      E.cx = COL_OFFSET;
+      if (r->len) editorInsertText(text, r->len);
+      break;
+    case SWAP_DELETE_ROW:
+      if (!row) return 0;
+      addUndoDeleteRow(r->y, editorRowChars(row), row->size);
+      editorDelRow(r->y);
+      break;
+    case SWAP_SET_ROW: {
+      // Rows set in a row are recorded together, as :s would.
+      if (!row) return 0;
+      struct rowText rt = {r->y, malloc(r->len + 1), r->len};
+      memcpy(rt.text, text, r->len);
+      rt.text[r->len] = '\0';
+      editorRowSwapText(row, &rt.text, &rt.len);
+      abAppend(rows, (const char *)&rt, sizeof(rt));
+      break;
+    }
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+void swapFlushRows(struct abuf *rows) {
+  if (rows->len == 0) return;
+  struct rowText *list = malloc(rows->len);
+  memcpy(list, rows->b, rows->len);
+  addUndoRows(E.cy, E.cx, list, rows->len / sizeof(struct rowText));
+  rows->len = 0;
+}
+
+int swapAskRecover() {
+  while (1) {
+    editorSetStatusMessage("Recover the unsaved changes in %s? (y/n)",
+                           sw.path);
+    editorRefreshScreen();
+    int c = editorReadKey();
+    if (c == 'y' || c == 'Y') return 1;
+    if (c == 'n' || c == 'N') return 0;
+  }
+}
+
+// Replays the swap file into the buffer if it was made for the file as it
+// is on disk and the user wants it. Returns whether it did.
+int swapRecover(const char *filename) {
+  struct stat st;
+  char *data = NULL;
+  if (fstat(sw.fd, &st) == 0 &&
+      st.st_size > (off_t)sizeof(struct swapHeader)) {
+    data = malloc(st.st_size);
+    if (pread(sw.fd, data, st.st_size, 0) != st.st_size) {
+      free(data);
+      data = NULL;
+    }
+  }
+  if (!data) return 0;
+
+  struct swapHeader h;
+  memcpy(&h, data, sizeof(h));
+  uint64_t size, hash;
+  if (memcmp(h.magic, SWAP_MAGIC, 8) ||
+      !editorHashFile(filename, &size, &hash) || size != h.size ||
+      hash != h.hash || !swapAskRecover()) {
+    editorSetStatusMessage("");
+    free(data);
+    return 0;
+  }
+
+  int changes = 0;
+  struct abuf rows = ABUF_INIT;
+  sw.recovering = 1;
+  closeUndoGroup();
+  size_t p = sizeof(h);
+  struct swapRecord r;
+  while (p + sizeof(r) <= (size_t)st.st_size) {
+    memcpy(&r, data + p, sizeof(r));
+    p += sizeof(r);
+    // A record cut short by the crash ends the log.
+    if (r.len < 0 || (size_t)r.len > st.st_size - p) break;
+    if (r.kind != SWAP_SET_ROW) {
+      swapFlushRows(&rows);
+      closeUndoGroup();
+    }
+    if (!swapApply(&r, data + p, &rows)) break;
+    p += r.len;
+    changes++;
+  }
+  swapFlushRows(&rows);
+  closeUndoGroup();
+  sw.recovering = 0;
+  abFree(&rows);
+  free(data);
+  E.cy = 0;
+  E.cx = COL_OFFSET;
+  if (changes)
+    editorSetStatusMessage("Recovered %d changes from %s", changes, sw.path);
+  return changes > 0;
+}
+
+// Opens and locks the swap file. Returns -1 if another session holds it.
+int swapLock() {
+  while (1) {
+    int fd = open(sw.path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd == -1) return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    // The session that held the lock may have removed the file before
+    // letting go of it, so the lock has to be on the file at the path.
+    struct stat fst, pst;
+    if (fstat(fd, &fst) == 0 && stat(sw.path, &pst) == 0 &&
+        fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino)
+      return fd;
+    close(fd);
+  }
+}
+
+void editorSwapOpen(const char *filename) {
+  editorSwapClose();
+  sw.path = editorSideFilePath(filename, "swap");
+  memcpy(sw.header.magic, SWAP_MAGIC, 8);
+  sw.fd = swapLock();
+  if (sw.fd == -1) {
+    if (errno == EWOULDBLOCK)
+      editorSetStatusMessage("%s is in use, changes are not logged", sw.path);
+    return;
+  }
+  // Later changes are appended to recovered ones, or start the file over.
+  if (!swapRecover(filename)) {
+    sw.reset = 1;
+    sw.base = strdup(filename);
+  }
+  sw.stop = 0;
+  sw.running = !pthread_create(&sw.thread, NULL, swapWriterRun, NULL);
+}
+
+// Stops logging and removes the swap file, once its changes are saved or
+// deliberately dropped.
+void editorSwapClose() {
+  if (sw.running) {
+    pthread_mutex_lock(&sw.lock);
+    sw.stop = 1;
+    pthread_cond_signal(&sw.cond);
+    pthread_mutex_unlock(&sw.lock);
+    pthread_join(sw.thread, NULL);
+    sw.running = 0;
+  }
+  // Removed while still locked, so no other session picks it up.
+  if (sw.fd != -1) {
+    unlink(sw.path);
+    close(sw.fd);
+    sw.fd = -1;
+  }
+  free(sw.path);
+  sw.path = NULL;
+  free(sw.base);
+  sw.base = NULL;
+  sw.pending.len = 0;
+  sw.marked.len = 0;
+  sw.marking = 0;
+  sw.last = -1;
+  sw.reset = 0;
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include "syntax.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "highlight.h"
+#include "output.h"
+
+/*** syntax files ***/
+// Syntax definitions are read at startup from $XDG_CONFIG_HOME/avi/syntax,
+// or ~/.config/avi/syntax, one language per file. Each line holds a
+// directive and its space separated values; lines starting with # are
+// ignored:
+//
+//   filetype python
+//   match .py SConstruct
+//   keywords if elif else for while def return
+//   types int str float
+//   comment #
+//   multiline """ """
+//   strings "'
+//   numbers on
+//
+// match takes extensions (starting with .) or parts of file names, and
+// types are highlighted like the keywords ending in | in HLDB.
+
+// Appends a copy of word to a NULL terminated list.
+char **syntaxListAdd(char **list, const char *word, const char *suffix) {
+  int n = 0;
+  while (list && list[n]) n++;
+  list = realloc(list, sizeof(char *) * (n + 2));
+  list[n] = malloc(strlen(word) + strlen(suffix) + 1);
+  strcpy(list[n], word);
+  strcat(list[n], suffix);
+  list[n + 1] = NULL;
+  return list;
+}
+
+void syntaxListFree(char **list) {
+  for (int i = 0; list && list[i]; i++) free(list[i]);
+  free(list);
+}
+
+void syntaxFree(struct editorSyntax *s) {
+  free(s->filetype);
+  syntaxListFree(s->filematch);
+  syntaxListFree(s->keywords);
+  free(s->singleline_comment_start);
+  free(s->multiline_comment_start);
+  free(s->multiline_comment_end);
+  free(s->quotes);
+  free(s);
+}
+
+// Parses one definition file. Returns 0 and sets the status message if
+// the file has an error.
+int syntaxLoadFile(const char *path, struct editorSyntax *s) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return 0;
+  char *line = NULL;
+  size_t cap = 0;
+  int lineno = 0, ok = 1;
+  while (ok && getline(&line, &cap, fp) != -1) {
+    lineno++;
+    if (line[0] == '#') continue;
+    char *save;
+    char *directive = strtok_r(line, " \t\r\n", &save);
+    if (!directive) continue;
+    char *values[3] = {NULL, NULL, NULL};
+    int nvalues = 0;
+    char *v;
+    while ((v = strtok_r(NULL, " \t\r\n", &save))) {
+      if (nvalues < 3) values[nvalues] = v;
+      nvalues++;
+      if (!strcmp(directive, "match"))
+        s->filematch = syntaxListAdd(s->filematch, v, "");
+      else if (!strcmp(directive, "keywords"))
+        s->keywords = syntaxListAdd(s->keywords, v, "");
+      else if (!strcmp(directive, "types"))
+        s->keywords = syntaxListAdd(s->keywords, v, "|");
+    }
+
+    if (!strcmp(directive, "match") || !strcmp(directive, "keywords") ||
+        !strcmp(directive, "types")) {
+      continue;
+    } else if (!strcmp(directive, "filetype") && nvalues == 1) {
+      free(s->filetype);
+      s->filetype = strdup(values[0]);
+    } else if (!strcmp(directive, "comment") && nvalues == 1) {
+      free(s->singleline_comment_start);
+      s->singleline_comment_start = strdup(values[0]);
+    } else if (!strcmp(directive, "multiline") && nvalues == 2) {
+      free(s->multiline_comment_start);
+      free(s->multiline_comment_end);
+      s->multiline_comment_start = strdup(values[0]);
+      s->multiline_comment_end = strdup(values[1]);
+    } else if (!strcmp(directive, "strings") && nvalues == 1) {
+      free(s->quotes);
+      s->quotes = strdup(values[0]);
+      s->flags |= HL_HIGHLIGHT_STRINGS;
+    } else if (!strcmp(directive, "numbers") && nvalues == 1 &&
+               (!strcmp(values[0], "on") || !strcmp(values[0], "off"))) {
+      if (!strcmp(values[0], "on"))
+        s->flags |= HL_HIGHLIGHT_NUMBERS;
+      else
+        s->flags &= ~HL_HIGHLIGHT_NUMBERS;
+    } else {
+      editorSetStatusMessage("%s:%d: bad directive: %s", path, lineno,
+                             directive);
+      ok = 0;
+    }
+  }
+  free(line);
+  fclose(fp);
+  if (ok && (!s->filetype || !s->filematch)) {
+    editorSetStatusMessage("%s: needs a filetype and a match", path);
+    ok = 0;
+  }
+  return ok;
+}
+
+void editorLoadSyntaxFiles() {
+  char dir[1024];
+  char *config = getenv("XDG_CONFIG_HOME");
+  char *home = getenv("HOME");
+  if (config && config[0])
+    snprintf(dir, sizeof(dir), "%s/avi/syntax", config);
+  else if (home)
+    snprintf(dir, sizeof(dir), "%s/.config/avi/syntax", home);
+  else
+    return;
+
+  struct dirent **names;
+  int n = scandir(dir, &names, NULL, alphasort);
+  if (n < 0) return;
+  for (int i = 0; i < n; i++) {
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+    if (names[i]->d_name[0] != '.' && names[i]->d_type != DT_DIR) {
+      struct editorSyntax *s = calloc(1, sizeof(*s));
+      if (syntaxLoadFile(path, s)) {
+        if (!s->keywords) s->keywords = calloc(1, sizeof(char *));
+        editorAddSyntax(s);
+      } else {
+        syntaxFree(s);
+      }
+    }
+    free(names[i]);
+  }
+  free(names);
+}
@@ -1,10 +1,12 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "definitions.h"
+#include "event.h"
 
 /*** terminal ***/
 void die(const char *s) {
@@ -22,6 +24,7 @@ void cleanExit() {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);  // Disable bracketed paste
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) ==
       -1)  // Discard unhandled input and reset terminal settings to the
            // original
@@ -44,26 +47,137 @@ void enableRawMode() {
                    ISIG);  // Disable local flags. ECHO: echo, ICANON: Turn off
                            // canonical mode (read input byte-by-byte), IEXTEN:
                            // Fix Ctrl-O, ISIG: Disable Ctrl-C and Ctrl-Z
-  raw.c_cc[VMIN] = 0;  // Minimum bytes of input needed before read() can return
-  raw.c_cc[VTIME] = 1;  // Maximum time to wait before read() returns
+  raw.c_cc[VMIN] = 1;   // Reads only happen once poll() reports input
+  raw.c_cc[VTIME] = 0;  // so they never need to time out
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);  // Enable bracketed paste
 }
 
-int editorReadKey() {
-  int nread;
+/*** input buffer ***/
+// Everything the terminal has sent is read in one go and decoded from here,
+// so a paste or a burst of keys costs one read() instead of one per byte.
+#define ESC_SEQ_TIMEOUT 50  // ms to wait for the rest of an escape sequence
+
+struct inputBuffer {
+  char *b;
+  int len;
+  int pos;
+  int cap;
+};
+
+static struct inputBuffer input = {NULL, 0, 0, 0};
+
+void editorFillInput() {
+  if (input.pos == input.len) input.pos = input.len = 0;
+  if (input.len == input.cap) {
+    input.cap = input.cap ? input.cap * 2 : 4096;
+    input.b = realloc(input.b, input.cap);
+    if (input.b == NULL) die("realloc");
+  }
+  int nread = read(STDIN_FILENO, &input.b[input.len], input.cap - input.len);
+  if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+  if (nread > 0) input.len += nread;
+}
+
+// Queues bytes as if the terminal had sent them.
+void editorFeedInput(const char *s, int len) {
+  if (input.pos == input.len) input.pos = input.len = 0;
+  if (input.len + len > input.cap) {
+    while (input.len + len > input.cap)
+      input.cap = input.cap ? input.cap * 2 : 4096;
+    input.b = realloc(input.b, input.cap);
+    if (input.b == NULL) die("realloc");
+  }
+  memcpy(&input.b[input.len], s, len);
+  input.len += len;
+}
+
+// Returns 1 if a key can be read without blocking.
+int editorInputPending() {
+  if (input.pos < input.len) return 1;
+  if (editorWaitForInput(0)) editorFillInput();
+  return input.pos < input.len;
+}
+
+int editorReadByte(char *c, int timeout) {
+  if (input.pos == input.len) {
+    if (!editorWaitForInput(timeout)) return 0;
+    editorFillInput();
+    if (input.pos == input.len) return 0;
+  }
+  *c = input.b[input.pos++];
+  return 1;
+}
+
+/*** bracketed paste ***/
+// Text pasted between \x1b[200~ and \x1b[201~ is handed over as one
+// PASTE_KEY so it can be inserted in bulk. Line breaks are normalised to \n.
+static char *paste = NULL;
+static int pastelen = 0;
+
+void editorReadPaste() {
+  const char *end = "\x1b[201~";
+  int endlen = strlen(end);
+  int cap = 4096;
+  free(paste);
+  paste = malloc(cap);
+  pastelen = 0;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
+  while (pastelen < endlen || memcmp(&paste[pastelen - endlen], end, endlen)) {
+    if (!editorReadByte(&c, -1)) continue;
+    if (pastelen == cap) {
+      cap *= 2;
+      paste = realloc(paste, cap);
+      if (paste == NULL) die("realloc");
+    }
+    paste[pastelen++] = c;
   }
+  pastelen -= endlen;
+
+  int len = 0;
+  for (int i = 0; i < pastelen; i++) {
+    if (paste[i] == '\r') {
+      if (i + 1 < pastelen && paste[i + 1] == '\n') i++;
+      paste[len++] = '\n';
+    } else {
+      paste[len++] = paste[i];
+    }
+  }
+  pastelen = len;
+}
+
+// Returns the text of the last PASTE_KEY. The caller owns it.
+char *editorTakePaste(int *len) {
+  char *text = paste;
+  *len = pastelen;
+  paste = NULL;
+  pastelen = 0;
+  return text;
+}
+
+int editorReadKey() {
+  char c;
+  while (!editorReadByte(&c, -1))
+    ;
   if (c == '\x1b') {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (!editorReadByte(&seq[0], ESC_SEQ_TIMEOUT)) return '\x1b';
+    if (!editorReadByte(&seq[1], ESC_SEQ_TIMEOUT)) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (!editorReadByte(&seq[2], ESC_SEQ_TIMEOUT)) return '\x1b';
+        if (seq[1] == '2' && seq[2] == '0') {
+          char tail[2];
+          if (!editorReadByte(&tail[0], ESC_SEQ_TIMEOUT)) return '\x1b';
+          if (!editorReadByte(&tail[1], ESC_SEQ_TIMEOUT)) return '\x1b';
+          if (tail[0] == '0' && tail[1] == '~') {
+            editorReadPaste();
+            return PASTE_KEY;
+          }
+          return '\x1b';
+        }
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1':
@@ -129,14 +243,18 @@ int getCursorPosition(int *rows, int *cols) {
   return 0;
 }
 
-int getWindowSize(int *rows, int *cols) {
+// Asks the kernel only, so unlike the cursor report it never reads input.
+int getWindowSizeIoctl(int *rows, int *cols) {
   struct winsize ws;
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-    return getCursorPosition(rows, cols);
-  } else {
-    *cols = ws.ws_col;
-    *rows = ws.ws_row;
-    return 0;
-  }
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    return -1;
+  *cols = ws.ws_col;
+  *rows = ws.ws_row;
+  return 0;
+}
+
+int getWindowSize(int *rows, int *cols) {
+  if (getWindowSizeIoctl(rows, cols) == 0) return 0;
+  if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+  return getCursorPosition(rows, cols);
 }